@@ -13,6 +13,11 @@ public:
     AABB(const Vec3& minv, const Vec3& maxv): minV(minv), maxV(maxv) {  } 
     Vec3 min() const {return minV;}
     Vec3 max() const {return maxV;} 
+    Vec3 centroid() const { return (minV + maxV) * 0.5; }
+    double surface_area() const {
+        Vec3 d = maxV - minV;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
     // 基于slab的长方体求交算法，LEC4  
     bool hit(const Ray& r, double& t_min, double t_max) const {
         Vec3 minVV = minV, maxVV = maxV;
@@ -0,0 +1,219 @@
+// Ray throughput of the BVH layouts on one mesh.
+// g++ -O2 -fopenmp -o bench_bvh bench_bvh.cpp -std=c++14
+// ./bench_bvh objects/horse.fine.90k.obj [n_rays]
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include "utils.hpp"
+#include "mesh.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+// Rays from a sphere around the mesh towards random points inside its box,
+// so most of them hit and some graze the silhouette.
+std::vector<Ray> make_rays(const AABB& box, int n) {
+    srand48(1);
+    Vec3 c = box.centroid(), ext = box.max() - box.min();
+    double radius = ext.len();
+    std::vector<Ray> rays;
+    rays.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        Vec3 dir;
+        do {
+            dir = Vec3(drand48(), drand48(), drand48()) * 2 - Vec3(1, 1, 1);
+        } while (dir.len() > 1 || dir.len() < 1e-3);
+        Vec3 o = c + dir.normalized() * radius;
+        Vec3 target = box.min() + ext.mult(Vec3(drand48(), drand48(), drand48()));
+        rays.push_back(Ray(o, target - o));
+    }
+    return rays;
+}
+
+// Closest hit distance per ray, or -1.
+template <class Trace>
+double run(const char* name, const std::vector<Ray>& rays, std::vector<double>& t, Trace trace) {
+    t.assign(rays.size(), -1);
+    auto start = Clock::now();
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < (int) rays.size(); ++i) {
+        Hit hit;
+        if (trace(rays[i], hit))
+            t[i] = hit.t;
+    }
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    double mrays = rays.size() / secs * 1e-6;
+    printf("%-8s %8.2f Mrays/s\n", name, mrays);
+    return mrays;
+}
+
+// Any-hit query over the same rays; counts rays whose answer disagrees
+// with the closest hit distances in `t`.
+template <class Occluded>
+int run_occluded(const char* name, const std::vector<Ray>& rays, const std::vector<double>& t,
+                 double base, Occluded occluded) {
+    std::vector<char> blocked(rays.size());
+    auto start = Clock::now();
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < (int) rays.size(); ++i)
+        blocked[i] = occluded(rays[i]);
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    double mrays = rays.size() / secs * 1e-6;
+    int mismatch = 0;
+    for (int i = 0; i < (int) rays.size(); ++i)
+        if (bool(blocked[i]) != (t[i] >= 0))
+            ++mismatch;
+    printf("%-8s %8.2f Mrays/s any hit, %.2fx closest, %d mismatches\n", name, mrays,
+           mrays / base, mismatch);
+    return mismatch;
+}
+
+// Pinhole camera rays looking at the box from outside, in 8x8 pixel blocks
+// of PACKET_SIZE consecutive rays.
+std::vector<Ray> make_camera_rays(const AABB& box, int n) {
+    Vec3 c = box.centroid(), ext = box.max() - box.min();
+    Vec3 eye = c + Vec3(0.3, 0.4, 1).normalized() * ext.len() * 1.5;
+    Vec3 w = (c - eye).normalized(), u = (w % Vec3(0, 1, 0)).normalized(), v = u % w;
+    double half = 0.5 * ext.len() / (c - eye).len();  // the box fills the view
+    int side = std::max(8, int(sqrt(double(n))) / 8 * 8);
+    std::vector<Ray> rays;
+    rays.reserve(size_t(side) * side);
+    for (int by = 0; by < side; by += 8)
+        for (int bx = 0; bx < side; bx += 8)
+            for (int y = by; y < by + 8; ++y)
+                for (int x = bx; x < bx + 8; ++x) {
+                    double px = (2 * (x + 0.5) / side - 1) * half, py = (2 * (y + 0.5) / side - 1) * half;
+                    rays.push_back(Ray(eye, w + u * px + v * py));
+                }
+    return rays;
+}
+
+// Closest hits of consecutive rays traced as packets.
+double run_packets(const char* name, const Object& obj, const std::vector<Ray>& rays,
+                   std::vector<double>& t, double base) {
+    t.assign(rays.size(), -1);
+    int n_packets = int((rays.size() + PACKET_SIZE - 1) / PACKET_SIZE);
+    auto start = Clock::now();
+#pragma omp parallel
+    {
+        RayPacket* p = new RayPacket;
+#pragma omp for schedule(dynamic, 16)
+        for (int k = 0; k < n_packets; ++k) {
+            p->clear();
+            for (int i = k * PACKET_SIZE; i < std::min(int(rays.size()), (k + 1) * PACKET_SIZE); ++i)
+                p->add(rays[i], MAX_double);
+            p->t_min = 1e-6;
+            p->prepare();
+            obj.intersect_packet(*p, 0);
+            for (int i = 0; i < p->n; ++i)
+                if (p->found[i])
+                    t[k * PACKET_SIZE + i] = p->hits[i].t;
+        }
+        delete p;
+    }
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    double mrays = rays.size() / secs * 1e-6;
+    printf("%-8s %8.2f Mrays/s packets, %.2fx single rays\n", name, mrays, mrays / base);
+    return mrays;
+}
+
+int compare(const std::vector<double>& a, const std::vector<double>& b) {
+    int mismatch = 0;
+    for (int i = 0; i < (int) a.size(); ++i)
+        if ((a[i] < 0) != (b[i] < 0) || fabs(a[i] - b[i]) > 1e-6 * (1 + fabs(a[i])))
+            ++mismatch;
+    return mismatch;
+}
+
+// Closest and any-hit mismatches of the mesh moved by `offset` in `layout`
+// against the tree, where float vertices and node bounds are coarse next
+// to the size of the triangles.
+int far_mismatches(const char* path, const Vec3& offset, BVHLayout layout, int n_rays) {
+    Vec3 scale(1, 1, 1);
+    Mesh mesh(path, nullptr, offset, scale, 0);
+    ObjectList* tris = mesh.get_all_triangles();
+    BVHOptions opt;
+    opt.builder = BVH_SAH;
+    BVH_node tree(tris->getList(), 0, int(tris->getList().size()), 0, 0, opt);
+    opt.layout = layout;
+    TriangleMesh moved(mesh, opt);
+    AABB box;
+    tree.bounding_box(0, 0, box);
+    std::vector<Ray> rays = make_rays(box, n_rays);
+    int mismatch = 0;
+#pragma omp parallel for schedule(dynamic, 1024) reduction(+ : mismatch)
+    for (int i = 0; i < (int) rays.size(); ++i) {
+        Hit a, b;
+        bool hit_a = tree.intersect(rays[i], 1e-6, MAX_double, a);
+        bool hit_b = moved.intersect(rays[i], 1e-6, MAX_double, b);
+        if (hit_a != hit_b || (hit_a && fabs(a.t - b.t) > 1e-6 * (1 + fabs(a.t)))
+            || moved.occluded(rays[i], 1e-6, MAX_double) != hit_a)
+            ++mismatch;
+    }
+    delete tris;
+    return mismatch;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("usage: %s <mesh.obj> [n_rays]\n", argv[0]);
+        return 1;
+    }
+    int n_rays = argc > 2 ? atoi(argv[2]) : 1000000;
+    Vec3 center(0, 0, 0), scale(1, 1, 1);
+    Mesh mesh(argv[1], nullptr, center, scale, 0);
+    ObjectList* tris = mesh.get_all_triangles();
+    BVHOptions opt;
+    opt.builder = BVH_SAH;
+    BVH_node tree(tris->getList(), 0, int(tris->getList().size()), 0, 0, opt);
+
+    std::vector<TriangleMesh*> meshes;
+    BVHLayout layouts[] = {BVH_LINEAR, BVH_WIDE4, BVH_WIDE8};
+    for (BVHLayout layout : layouts) {
+        Mesh m(argv[1], nullptr, center, scale, 0);
+        opt.layout = layout;
+        meshes.push_back(new TriangleMesh(m, opt));
+    }
+    AABB box;
+    tree.bounding_box(0, 0, box);
+    std::vector<Ray> rays = make_rays(box, n_rays);
+    printf("%d triangles, %d rays, AVX2 %s\n", meshes[0]->n_tris, n_rays,
+           BVH_HAS_AVX2 ? "yes" : "no");
+
+    std::vector<double> t_ref, t;
+    double base = run("tree", rays, t_ref, [&](const Ray& r, Hit& h) {
+        return tree.intersect(r, 1e-6, MAX_double, h);
+    });
+    const char* names[] = {"linear", "wide4", "wide8"};
+    for (int i = 0; i < 3; ++i) {
+        double mrays = run(names[i], rays, t, [&](const Ray& r, Hit& h) {
+            return meshes[i]->intersect(r, 1e-6, MAX_double, h);
+        });
+        printf("         %.2fx tree, %d mismatches\n", mrays / base, compare(t_ref, t));
+        run_occluded(names[i], rays, t, mrays, [&](const Ray& r) {
+            return meshes[i]->occluded(r, 1e-6, MAX_double);
+        });
+    }
+
+    // coherent primary rays, one at a time and as packets
+    std::vector<Ray> camera_rays = make_camera_rays(box, n_rays);
+    printf("%d camera rays\n", int(camera_rays.size()));
+    double base_linear = 0;
+    for (int i = 0; i < 3; ++i) {
+        double mrays = run(names[i], camera_rays, t_ref, [&](const Ray& r, Hit& h) {
+            return meshes[i]->intersect(r, 1e-6, MAX_double, h);
+        });
+        if (i == 0)
+            base_linear = mrays;
+    }
+    std::vector<double> t_packet;
+    run_packets("linear", *meshes[0], camera_rays, t_packet, base_linear);
+    printf("         %d mismatches\n", compare(t_ref, t_packet));
+
+    Vec3 offsets[] = {Vec3(1000, 1000, 1000), Vec3(3000, -2000, 1000), Vec3(1e5, 1e4, -1e5)};
+    for (const Vec3& offset : offsets)
+        for (int i = 0; i < 3; ++i)
+            printf("%-8s moved by (%g, %g, %g): %d mismatches\n", names[i], offset.x, offset.y, offset.z,
+                   far_mismatches(argv[1], offset, layouts[i], n_rays));
+    return 0;
+}
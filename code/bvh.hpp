@@ -4,7 +4,122 @@
 #include "shape.hpp"
 #include "bbox.hpp"
 #include <algorithm>
+#include <cfloat>
 #include <cstdio>
+#include <chrono>
+// build with -DBVH_NO_SIMD to use the scalar slab test everywhere
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(BVH_NO_SIMD)
+#include <immintrin.h>
+#define BVH_X86
+#endif
+
+#ifdef BVH_X86
+bool cpu_has_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+const bool BVH_HAS_AVX2 = cpu_has_avx2();
+#else
+const bool BVH_HAS_AVX2 = false;
+#endif
+
+// Box tests of a RayPacket. Boxes are given as lo[3], hi[3].
+
+// whether rays i..i+3 hit the box before their t_max, as 4 bits; the
+// slab test of bvh_node_hit
+inline int packet_hit4_scalar(const RayPacket& p, int i, const double lo[3], const double hi[3]) {
+    int mask = 0;
+    for (int k = i; k < i + 4; ++k) {
+        double t0 = p.t_min, t1 = p.t_max[k];
+        for (int a = 0; a < 3; ++a) {
+            double t_near = ((p.inv[a][k] < 0 ? hi[a] : lo[a]) - p.org[a][k]) * p.inv[a][k];
+            double t_far = ((p.inv[a][k] < 0 ? lo[a] : hi[a]) - p.org[a][k]) * p.inv[a][k];
+            if (t_near > t0) t0 = t_near;
+            if (t_far < t1) t1 = t_far;
+        }
+        mask |= (t0 <= t1) << (k - i);
+    }
+    return mask;
+}
+
+#ifdef BVH_X86
+// NaN distances (a zero direction component on a slab plane) are passed
+// over by the operand order of min/max, as in the scalar test
+__attribute__((target("avx2")))
+int packet_hit4_avx2(const RayPacket& p, int i, const double lo[3], const double hi[3]) {
+    __m256d t0 = _mm256_set1_pd(p.t_min), t1 = _mm256_loadu_pd(p.t_max + i);
+    for (int a = 0; a < 3; ++a) {
+        __m256d o = _mm256_loadu_pd(p.org[a] + i), inv = _mm256_loadu_pd(p.inv[a] + i);
+        __m256d ta = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(lo[a]), o), inv);
+        __m256d tb = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(hi[a]), o), inv);
+        t0 = _mm256_max_pd(_mm256_min_pd(ta, tb), t0);
+        t1 = _mm256_min_pd(_mm256_max_pd(ta, tb), t1);
+    }
+    return _mm256_movemask_pd(_mm256_cmp_pd(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+inline int packet_hit4(const RayPacket& p, int i, const double lo[3], const double hi[3]) {
+#ifdef BVH_X86
+    if (BVH_HAS_AVX2)
+        return packet_hit4_avx2(p, i, lo, hi);
+#endif
+    return packet_hit4_scalar(p, i, lo, hi);
+}
+
+// Whether no ray of a coherent packet can hit the box: interval bounds
+// of the entry and exit distances over all its origins and directions
+// (Boulos et al., "Geometric and Arithmetic Culling Methods").
+inline bool packet_culled(const RayPacket& p, const double lo[3], const double hi[3]) {
+    if (!p.coherent)
+        return false;
+    double t0 = p.t_min, t1 = p.t_max_all;
+    for (int a = 0; a < 3; ++a) {
+        bool neg = p.inv_lo[a] < 0;
+        double near = neg ? hi[a] : lo[a], far = neg ? lo[a] : hi[a];
+        // the extremes of (plane - o) * inv lie on the corners of the bounds
+        double n0 = (near - p.o_lo[a]) * p.inv_lo[a], n1 = (near - p.o_lo[a]) * p.inv_hi[a];
+        double n2 = (near - p.o_hi[a]) * p.inv_lo[a], n3 = (near - p.o_hi[a]) * p.inv_hi[a];
+        double f0 = (far - p.o_lo[a]) * p.inv_lo[a], f1 = (far - p.o_lo[a]) * p.inv_hi[a];
+        double f2 = (far - p.o_hi[a]) * p.inv_lo[a], f3 = (far - p.o_hi[a]) * p.inv_hi[a];
+        t0 = std::max(t0, std::min(std::min(n0, n1), std::min(n2, n3)));
+        t1 = std::min(t1, std::max(std::max(f0, f1), std::max(f2, f3)));
+        if (t0 > t1)
+            return true;
+    }
+    return false;
+}
+
+// bits of the rays in [first, n) among rays i..i+3
+inline int packet_lanes(const RayPacket& p, int i, int first) {
+    int mask = 0xf;
+    if (first > i)
+        mask &= 0xf << (first - i);
+    if (p.n < i + 4)
+        mask &= 0xf >> (i + 4 - p.n);
+    return mask;
+}
+
+// the first ray from `first` on that hits the box, p.n if none does
+inline int packet_first_hit(const RayPacket& p, const double lo[3], const double hi[3], int first) {
+    if (packet_culled(p, lo, hi))
+        return p.n;
+    for (int i = first & ~3; i < p.n; i += 4) {
+        int mask = packet_hit4(p, i, lo, hi) & packet_lanes(p, i, first);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return p.n;
+}
+
+// the rays from `first` on that hit the box, one bit each
+inline uint64_t packet_hit_mask(const RayPacket& p, const double lo[3], const double hi[3], int first) {
+    uint64_t mask = 0;
+    for (int i = first & ~3; i < p.n; i += 4)
+        mask |= uint64_t(packet_hit4(p, i, lo, hi) & packet_lanes(p, i, first)) << i;
+    return mask;
+}
+
 
 bool box_compare(Object* a, Object*b, int axes) {
     AABB boxA, boxB;
@@ -17,15 +132,179 @@ bool box_compareY(Object* a, Object*b) { return box_compare(a, b, 1); }
 bool box_compareZ(Object* a, Object*b) { return box_compare(a, b, 2); }
 
 
+enum BVHBuilder { BVH_MIDDLE, BVH_SAH };
+enum BVHLayout { BVH_TREE, BVH_LINEAR, BVH_WIDE4, BVH_WIDE8 };
+
+// BVH build parameters, set from the Accelerator block of the scene file.
+// Costs are relative to one bounding box test.
+struct BVHOptions {
+    BVHBuilder builder = BVH_MIDDLE;
+    int bins = 12;           // SAH buckets per axis
+    double leaf_cost = 1.0;  // cost of one primitive intersection
+    int max_leaf = 4;        // largest leaf the SAH builder may keep
+    int leaf_block = 1;      // primitives intersected together, leaf_cost is per block
+    BVHLayout layout = BVH_LINEAR;
+};
+
+// leaf cost of n primitives intersected leaf_block at a time
+inline double bvh_leaf_cost(int n, double leaf_cost, int leaf_block) {
+    return leaf_cost * ((n + leaf_block - 1) / leaf_block);
+}
+
+struct BVHPrimitive {
+    Object* obj;
+    int index;
+    AABB box;
+    Vec3 centroid;
+};
+
+// Binned surface area heuristic (SAH) split of prims[start, end).
+// Chooses the axis and bucket boundary with the lowest estimated cost and
+// partitions the range in place around it. Returns the split index and sets
+// `axis`, or returns -1 when intersecting the whole range as a single leaf
+// is cheaper.
+int sah_split(std::vector<BVHPrimitive>& prims, int start, int end,
+              const AABB& box, const BVHOptions& opt, int& axis) {
+    int num = end - start;
+    AABB cbox(prims[start].centroid, prims[start].centroid);
+    for (int i = start + 1; i < end; ++i)
+        cbox = combine_box(cbox, AABB(prims[i].centroid, prims[i].centroid));
+
+    const int MAX_BINS = 64;
+    int nbins = std::min(std::max(2, opt.bins), MAX_BINS);
+    AABB bin_box[MAX_BINS], right_box[MAX_BINS];
+    int bin_count[MAX_BINS];
+    double best_cost = MAX_double;
+    int best_axis = -1, best_bin = -1;
+    for (int axis = 0; axis < 3; ++axis) {
+        double lo = cbox.min()[axis], extent = cbox.max()[axis] - lo;
+        if (extent <= 0)
+            continue;
+        std::fill(bin_count, bin_count + nbins, 0);
+        for (int i = start; i < end; ++i) {
+            int b = int(nbins * (prims[i].centroid[axis] - lo) / extent);
+            b = std::min(b, nbins - 1);
+            bin_box[b] = bin_count[b]++ ? combine_box(bin_box[b], prims[i].box) : prims[i].box;
+        }
+        // sweep from the right to get the boxes of every right-hand side
+        int right_count = 0;
+        for (int b = nbins - 1; b > 0; --b) {
+            if (bin_count[b])
+                right_box[b] = right_count ? combine_box(right_box[b + 1], bin_box[b]) : bin_box[b];
+            else if (right_count)
+                right_box[b] = right_box[b + 1];
+            right_count += bin_count[b];
+        }
+        AABB left_box;
+        int left_count = 0;
+        right_count = num;
+        for (int b = 0; b < nbins - 1; ++b) {
+            if (bin_count[b])
+                left_box = left_count ? combine_box(left_box, bin_box[b]) : bin_box[b];
+            left_count += bin_count[b];
+            right_count -= bin_count[b];
+            if (left_count == 0 || right_count == 0)
+                continue;
+            double cl = bvh_leaf_cost(left_count, opt.leaf_cost, opt.leaf_block);
+            double cr = bvh_leaf_cost(right_count, opt.leaf_cost, opt.leaf_block);
+            double cost = 1 + (cl * left_box.surface_area() + cr * right_box[b + 1].surface_area())
+                / box.surface_area();
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    axis = std::max(best_axis, 0);
+    if (best_axis < 0) {
+        // all centroids coincide, no bucket boundary separates them
+        if (num <= opt.max_leaf)
+            return -1;
+        return start + num / 2;
+    }
+    if (num <= opt.max_leaf && best_cost >= bvh_leaf_cost(num, opt.leaf_cost, opt.leaf_block))
+        return -1;
+
+    double lo = cbox.min()[best_axis], extent = cbox.max()[best_axis] - lo;
+    auto mid = std::partition(prims.begin() + start, prims.begin() + end,
+        [=](const BVHPrimitive& p) {
+            int b = int(nbins * (p.centroid[best_axis] - lo) / extent);
+            return std::min(b, nbins - 1) <= best_bin;
+        });
+    return int(mid - prims.begin());
+}
+
+
 class BVH_node: public Object{
     static int count;
 
 public:
     BVH_node() = default;
-    BVH_node(const std::vector<Object*>& sl, int start, int end, double t0, double t1){
+    BVH_node(const std::vector<Object*>& sl, int start, int end, double t0, double t1,
+             const BVHOptions& opt = BVHOptions()) {
+        if (opt.builder == BVH_SAH) {
+            std::vector<BVHPrimitive> prims;
+            for (int i = start; i < end; ++i) {
+                BVHPrimitive p;
+                p.obj = sl[i];
+                p.index = i;
+                if (!p.obj->bounding_box(t0, t1, p.box))
+                    fprintf(stderr, "No bounding box in bvh_node constructor.\n");
+                p.centroid = p.box.centroid();
+                prims.push_back(p);
+            }
+            build_sah(prims, 0, int(prims.size()), opt);
+            return;
+        }
+        std::vector<Object*> l(sl.begin() + start, sl.begin() + end);
+        build_middle(l, 0, end - start, t0, t1, opt);
+    }
+    virtual bool intersect(const Ray& r, double t_min, double t_max, Hit& hit) const override {
+        double ttmin = t_min;
+        if (nbox.hit(r, ttmin, t_max)) {
+            bool Lhit = lc->intersect(r, t_min, t_max, hit);
+            bool Rhit = rc != lc && rc->intersect(r, t_min, Lhit ? hit.t : t_max, hit);
+            return Lhit || Rhit;
+        }
+        return false;
+    }
+    virtual bool occluded(const Ray& r, double t_min, double t_max) const override {
+        double ttmin = t_min;
+        return nbox.hit(r, ttmin, t_max)
+            && (lc->occluded(r, t_min, t_max) || (rc != lc && rc->occluded(r, t_min, t_max)));
+    }
+    virtual void intersect_packet(RayPacket& p, int first) const override {
+        double lo[3] = {nbox.min().x, nbox.min().y, nbox.min().z};
+        double hi[3] = {nbox.max().x, nbox.max().y, nbox.max().z};
+        first = packet_first_hit(p, lo, hi, first);
+        if (first == p.n)
+            return;
+        lc->intersect_packet(p, first);
+        if (rc != lc)
+            rc->intersect_packet(p, first);
+    }
+    virtual bool bounding_box(double t0, double t1, AABB& box) const override {
+        box = nbox;
+        return true;
+    }
+    virtual void set_id(int id_) override {
+        id = id_;
+        lc->set_id(id_);
+        if (rc != lc)
+            rc->set_id(id_);
+    }
+
+    Object *lc, *rc;
+    AABB nbox;
+    double cost;  // estimated SAH cost of the subtree, for comparing builders
+
+private:
+    // sorts l[start, end) in place, the list is never copied
+    void build_middle(std::vector<Object*>& l, int start, int end, double t0, double t1,
+                      const BVHOptions& opt) {
         int axis = int(3 * drand48());
-        auto l = sl;
-        // fprintf(stderr, "start %d  end %d \n", start, end);
         int num = end - start;
         auto *compare_function = (axis == 0) ? box_compareX
                               : (axis == 1) ? box_compareY
@@ -42,9 +321,11 @@ public:
         } else {
             std::sort(l.begin() + start, l.begin() + end, compare_function);
             int middle = start + num / 2;
-            lc = new BVH_node(l, start, middle, t0, t1);
-            rc = new BVH_node(l, middle, end, t0, t1);
-            
+            BVH_node* left = new BVH_node();
+            BVH_node* right = new BVH_node();
+            left->build_middle(l, start, middle, t0, t1, opt);
+            right->build_middle(l, middle, end, t0, t1, opt);
+            lc = left; rc = right;
         }
         AABB boxL, boxR;
 
@@ -55,38 +336,633 @@ public:
 
         nbox = combine_box(boxL, boxR);
         // fprintf(stderr, " ### %d, size of bbox %f \n", 0, (nbox.max() - nbox.min()).len());
+        compute_cost(opt);
     }
-    virtual bool intersect(const Ray& r, double t_min, double t_max, Hit& hit) const override {
-        double ttmin = t_min;
-        if (nbox.hit(r, ttmin, t_max)) {
-            Hit l_rec, r_rec;
-            bool Lhit = lc->intersect(r, t_min, t_max, l_rec);
-            bool Rhit = rc->intersect(r, t_min, t_max, r_rec);
-            if (Lhit && Rhit) {
-                if (l_rec.t < r_rec.t)
-                    hit = l_rec;
-                else
-                    hit = r_rec;
-                return true;
-            } else if (Lhit) {
-                hit = l_rec;
-                return true;
-            } else if (Rhit) {
-                hit = r_rec;
-                return true;
+    void build_sah(std::vector<BVHPrimitive>& prims, int start, int end, const BVHOptions& opt) {
+        int num = end - start;
+        nbox = prims[start].box;
+        for (int i = start + 1; i < end; ++i)
+            nbox = combine_box(nbox, prims[i].box);
+        int axis;
+        int middle = num > 2 ? sah_split(prims, start, end, nbox, opt, axis) : start + 1;
+        if (num == 1) {
+            lc = rc = prims[start].obj;
+        } else if (middle < 0) {
+            ObjectList* leaf = new ObjectList();
+            for (int i = start; i < end; ++i)
+                leaf->add(prims[i].obj);
+            lc = rc = leaf;
+        } else if (num == 2) {
+            lc = prims[start].obj; rc = prims[start+1].obj;
+        } else {
+            BVH_node* l = new BVH_node();
+            BVH_node* r = new BVH_node();
+            l->build_sah(prims, start, middle, opt);
+            r->build_sah(prims, middle, end, opt);
+            lc = l; rc = r;
+        }
+        compute_cost(opt);
+    }
+    double child_cost(Object* c, const BVHOptions& opt) const {
+        BVH_node* node = dynamic_cast<BVH_node*>(c);
+        if (node)
+            return node->cost;
+        ObjectList* leaf = dynamic_cast<ObjectList*>(c);
+        return opt.leaf_cost * (leaf ? leaf->size() : 1);
+    }
+    void compute_cost(const BVHOptions& opt) {
+        if (lc == rc) {
+            cost = 1 + child_cost(lc, opt);
+            return;
+        }
+        AABB boxL, boxR;
+        lc->bounding_box(0, 0, boxL);
+        rc->bounding_box(0, 0, boxR);
+        double area = nbox.surface_area();
+        if (area <= 0) {
+            cost = 1 + child_cost(lc, opt) + child_cost(rc, opt);
+            return;
+        }
+        cost = 1 + (boxL.surface_area() * child_cost(lc, opt)
+                  + boxR.surface_area() * child_cost(rc, opt)) / area;
+    }
+};
+
+int BVH_node::count = 0;
+
+
+// Node of a LinearBVH, 32 bytes. Nodes are stored in depth-first order, so
+// the first child of an interior node directly follows it and only the
+// second one needs an offset. Bounds are rounded outwards to float.
+struct LinearBVHNode {
+    float bmin[3], bmax[3];
+    int offset;              // leaf: first primitive, interior: second child
+    unsigned short n_prims;  // 0 for interior nodes
+    unsigned char axis;      // split axis of interior nodes
+    unsigned char pad;
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+// Temporary pointer tree, flattened into LinearBVHNodes once built.
+struct BVHBuildNode {
+    AABB box;
+    BVHBuildNode* child[2] = {nullptr, nullptr};
+    int axis = 0, offset = 0, n_prims = 0;
+    ~BVHBuildNode() { delete child[0]; delete child[1]; }
+};
+
+float round_down(double x) {
+    float f = float(x);
+    return f > x ? nextafterf(f, -INFINITY) : f;
+}
+float round_up(double x) {
+    float f = float(x);
+    return f < x ? nextafterf(f, INFINITY) : f;
+}
+
+// ranges smaller than this are built serially by the task that reaches them
+const int BVH_TASK_GRAIN = 4096;
+
+// Entries of the traversal stacks, which hold at most one node per level
+// of the tree.
+const int BVH_STACK_SIZE = 64;
+
+// Deepest level at which SAH splits a tree over n primitives. Below it
+// median splits take over, which add at most ceil(log2(n)) levels, so the
+// whole tree stays within BVH_STACK_SIZE levels.
+inline int bvh_sah_depth_limit(int n) {
+    int log2n = 0;
+    while ((1ll << log2n) < n)
+        ++log2n;
+    return std::min(48, BVH_STACK_SIZE - log2n);
+}
+
+// Builds the tree over prims[start, end), partitioning prims in place so
+// every leaf covers a contiguous range. Large subtrees are built as OpenMP
+// tasks, call it from inside a parallel region to use them. `count`
+// receives the number of nodes; SAH splits stop below `sah_depth` (see
+// bvh_sah_depth_limit).
+BVHBuildNode* bvh_build(std::vector<BVHPrimitive>& prims, int start, int end,
+                        const BVHOptions& opt, int depth, int sah_depth, int& count) {
+    BVHBuildNode* node = new BVHBuildNode();
+#pragma omp atomic
+    ++count;
+    int num = end - start;
+    node->box = prims[start].box;
+    for (int i = start + 1; i < end; ++i)
+        node->box = combine_box(node->box, prims[i].box);
+
+    int middle = -1;
+    if (opt.builder == BVH_SAH && num > 1 && depth < sah_depth) {
+        middle = sah_split(prims, start, end, node->box, opt, node->axis);
+    } else if (num > 2) {
+        // a hash of the range instead of drand48, which is not safe to share between tasks
+        node->axis = opt.builder == BVH_SAH ? depth % 3 : int((unsigned(start) * 2654435761u) >> 16) % 3;
+        middle = start + num / 2;
+        int axis = node->axis;
+        std::nth_element(prims.begin() + start, prims.begin() + middle, prims.begin() + end,
+            [axis](const BVHPrimitive& a, const BVHPrimitive& b) {
+                return a.centroid[axis] < b.centroid[axis];
+            });
+    }
+    if (middle < 0) {
+        node->offset = start;
+        node->n_prims = num;
+        return node;
+    }
+#pragma omp task shared(prims, opt, count) if (num > BVH_TASK_GRAIN)
+    node->child[0] = bvh_build(prims, start, middle, opt, depth + 1, sah_depth, count);
+    node->child[1] = bvh_build(prims, middle, end, opt, depth + 1, sah_depth, count);
+#pragma omp taskwait
+    return node;
+}
+
+
+// Flattens the subtree `b` into nodes[next...] in depth-first order and
+// returns its index.
+int bvh_flatten(const BVHBuildNode* b, LinearBVHNode* nodes, int& next) {
+    int idx = next++;
+    LinearBVHNode& node = nodes[idx];
+    for (int i = 0; i < 3; ++i) {
+        node.bmin[i] = round_down(b->box.min()[i]);
+        node.bmax[i] = round_up(b->box.max()[i]);
+    }
+    node.axis = b->axis;
+    node.pad = 0;
+    if (b->n_prims > 0) {
+        node.offset = b->offset;
+        node.n_prims = b->n_prims;
+    } else {
+        node.n_prims = 0;
+        bvh_flatten(b->child[0], nodes, next);
+        node.offset = bvh_flatten(b->child[1], nodes, next);
+    }
+    return idx;
+}
+
+// Builds and flattens a BVH over prims, which end up in leaf order.
+std::vector<LinearBVHNode> bvh_build_linear(std::vector<BVHPrimitive>& prims,
+                                            const BVHOptions& opt) {
+    std::vector<LinearBVHNode> nodes;
+    if (prims.empty())
+        return nodes;
+    int count = 0;
+    BVHBuildNode* root;
+#pragma omp parallel
+#pragma omp single
+    root = bvh_build(prims, 0, int(prims.size()), opt, 0, bvh_sah_depth_limit(int(prims.size())), count);
+    nodes.resize(count);
+    int next = 0;
+    bvh_flatten(root, nodes.data(), next);
+    delete root;
+    return nodes;
+}
+
+bool bvh_node_hit(const LinearBVHNode& n, const Vec3& o, const Vec3& inv_dir,
+                  const int dir_neg[3], double t0, double t1) {
+    for (int i = 0; i < 3; ++i) {
+        double t_near = ((dir_neg[i] ? n.bmax[i] : n.bmin[i]) - o[i]) * inv_dir[i];
+        double t_far = ((dir_neg[i] ? n.bmin[i] : n.bmax[i]) - o[i]) * inv_dir[i];
+        if (t_near > t0) t0 = t_near;
+        if (t_far < t1) t1 = t_far;
+        if (t0 > t1) return false;
+    }
+    return true;
+}
+
+// Stack based traversal of a flattened BVH, nearer child first.
+// `leaf(offset, n_prims, t_max)` intersects the primitives of one leaf,
+// lowers t_max to the closest hit and returns whether it found one.
+// With `any_hit` the traversal stops at the first leaf that finds a hit.
+template <class Leaf>
+bool bvh_traverse(const LinearBVHNode* nodes, const Ray& r, double t_min, double& t_max,
+                  Leaf leaf, bool any_hit = false) {
+    Vec3 inv_dir(1 / r.d.x, 1 / r.d.y, 1 / r.d.z);
+    int dir_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+    int stack[BVH_STACK_SIZE], sp = 0, cur = 0;
+    bool found = false;
+    while (true) {
+        const LinearBVHNode& node = nodes[cur];
+        if (bvh_node_hit(node, r.o, inv_dir, dir_neg, t_min, t_max)) {
+            if (node.n_prims > 0) {
+                if (leaf(node.offset, int(node.n_prims), t_max)) {
+                    found = true;
+                    if (any_hit) break;
+                }
+                if (sp == 0) break;
+                cur = stack[--sp];
+            } else if (dir_neg[node.axis]) {
+                stack[sp++] = cur + 1;
+                cur = node.offset;
+            } else {
+                stack[sp++] = node.offset;
+                cur = cur + 1;
             }
+        } else {
+            if (sp == 0) break;
+            cur = stack[--sp];
         }
-        return false;
     }
+    return found;
+}
+
+// bvh_traverse for a packet (Wald et al., "Ray Tracing Deformable Scenes
+// using Dynamic Bounding Volume Hierarchies"). A node is entered with the
+// first ray that hits it and the rays before it skip the subtree; the
+// children are visited in the order of that ray. `leaf(node, first, lo,
+// hi)` intersects the rays from `first` on with the leaf whose box is lo,
+// hi. Rays before the `first` passed in take no part.
+template <class Leaf>
+void bvh_traverse_packet(const LinearBVHNode* nodes, RayPacket& p, int first, Leaf leaf) {
+    struct Entry { int node, first; } stack[BVH_STACK_SIZE], cur = {0, first};
+    int sp = 0;
+    while (true) {
+        const LinearBVHNode& node = nodes[cur.node];
+        double lo[3] = {node.bmin[0], node.bmin[1], node.bmin[2]};
+        double hi[3] = {node.bmax[0], node.bmax[1], node.bmax[2]};
+        int lead = packet_first_hit(p, lo, hi, cur.first);
+        if (lead < p.n) {
+            if (node.n_prims > 0) {
+                leaf(node, lead, lo, hi);
+            } else {
+                int near = cur.node + 1, far = node.offset;
+                if (p.inv[node.axis][lead] < 0)
+                    std::swap(near, far);
+                stack[sp++] = {far, lead};
+                cur = {near, lead};
+                continue;
+            }
+        }
+        if (sp == 0) break;
+        cur = stack[--sp];
+    }
+}
+
+double bvh_node_area(const LinearBVHNode& n) {
+    double dx = n.bmax[0] - n.bmin[0], dy = n.bmax[1] - n.bmin[1], dz = n.bmax[2] - n.bmin[2];
+    return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+// estimated SAH cost of the subtree rooted at `node`, for comparing builders
+double bvh_cost(const LinearBVHNode* nodes, double leaf_cost, int leaf_block = 1, int node = 0) {
+    const LinearBVHNode& n = nodes[node];
+    if (n.n_prims > 0)
+        return bvh_leaf_cost(n.n_prims, leaf_cost, leaf_block);
+    double area = bvh_node_area(n);
+    double cl = bvh_cost(nodes, leaf_cost, leaf_block, node + 1);
+    double cr = bvh_cost(nodes, leaf_cost, leaf_block, n.offset);
+    if (area <= 0)
+        return 1 + cl + cr;
+    return 1 + (bvh_node_area(nodes[node + 1]) * cl + bvh_node_area(nodes[n.offset]) * cr) / area;
+}
+
+AABB bvh_root_box(const LinearBVHNode* nodes) {
+    return AABB(Vec3(nodes[0].bmin[0], nodes[0].bmin[1], nodes[0].bmin[2]),
+                Vec3(nodes[0].bmax[0], nodes[0].bmax[1], nodes[0].bmax[2]));
+}
+
+
+// Node of a WideBVH: up to N children whose bounds are stored as structure
+// of arrays, so one SIMD slab test checks all of them against a ray.
+template <int N>
+struct WideBVHNode {
+    float bmin[3][N], bmax[3][N];
+    int child[N];  // interior: node index, leaf: first primitive
+    int count[N];  // leaf: number of primitives, interior: 0
+    int n_children;
+};
+
+// Slab test of every child of `n`; returns a bit mask of the children hit
+// within [t_min, t_max] and their entry distances in tnear. The rounding
+// of the ray origin to float moves the slab distances of axis a by up to
+// err[a], by which every slab is widened; the factor on the far distance
+// absorbs the rounding of the arithmetic.
+template <int N>
+int wide_hit_scalar(const WideBVHNode<N>& n, const float o[3], const float inv[3], const float err[3],
+                    float t_min, float t_max, float tnear[N]) {
+    int mask = 0;
+    for (int i = 0; i < n.n_children; ++i) {
+        float t0 = t_min, t1 = t_max;
+        for (int a = 0; a < 3; ++a) {
+            float tn = (n.bmin[a][i] - o[a]) * inv[a];
+            float tf = (n.bmax[a][i] - o[a]) * inv[a];
+            if (tn > tf) std::swap(tn, tf);
+            tn -= err[a];
+            tf = tf * 1.0000004f + err[a];
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        tnear[i] = t0;
+        mask |= (t0 <= t1) << i;
+    }
+    return mask;
+}
+
+#ifdef BVH_X86
+inline int wide_hit_sse(const WideBVHNode<4>& n, const float o[3], const float inv[3], const float err[3],
+                        float t_min, float t_max, float tnear[4]) {
+    __m128 t0 = _mm_set1_ps(t_min), t1 = _mm_set1_ps(t_max);
+    const __m128 widen = _mm_set1_ps(1.0000004f);
+    for (int a = 0; a < 3; ++a) {
+        __m128 oa = _mm_set1_ps(o[a]), inva = _mm_set1_ps(inv[a]), erra = _mm_set1_ps(err[a]);
+        __m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.bmin[a]), oa), inva);
+        __m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.bmax[a]), oa), inva);
+        t0 = _mm_max_ps(t0, _mm_sub_ps(_mm_min_ps(ta, tb), erra));
+        t1 = _mm_min_ps(t1, _mm_add_ps(_mm_mul_ps(_mm_max_ps(ta, tb), widen), erra));
+    }
+    _mm_storeu_ps(tnear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << n.n_children) - 1);
+}
+
+__attribute__((target("avx2")))
+int wide_hit_avx2(const WideBVHNode<8>& n, const float o[3], const float inv[3], const float err[3],
+                  float t_min, float t_max, float tnear[8]) {
+    __m256 t0 = _mm256_set1_ps(t_min), t1 = _mm256_set1_ps(t_max);
+    const __m256 widen = _mm256_set1_ps(1.0000004f);
+    for (int a = 0; a < 3; ++a) {
+        __m256 oa = _mm256_set1_ps(o[a]), inva = _mm256_set1_ps(inv[a]), erra = _mm256_set1_ps(err[a]);
+        __m256 ta = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(n.bmin[a]), oa), inva);
+        __m256 tb = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(n.bmax[a]), oa), inva);
+        t0 = _mm256_max_ps(t0, _mm256_sub_ps(_mm256_min_ps(ta, tb), erra));
+        t1 = _mm256_min_ps(t1, _mm256_add_ps(_mm256_mul_ps(_mm256_max_ps(ta, tb), widen), erra));
+    }
+    _mm256_storeu_ps(tnear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & ((1 << n.n_children) - 1);
+}
+#endif
+
+template <int N>
+int wide_hit(const WideBVHNode<N>& n, const float o[3], const float inv[3], const float err[3],
+             float t_min, float t_max, float tnear[N]) {
+    return wide_hit_scalar(n, o, inv, err, t_min, t_max, tnear);
+}
+
+template <>
+int wide_hit<4>(const WideBVHNode<4>& n, const float o[3], const float inv[3], const float err[3],
+                float t_min, float t_max, float tnear[4]) {
+#ifdef BVH_X86
+    return wide_hit_sse(n, o, inv, err, t_min, t_max, tnear);
+#else
+    return wide_hit_scalar(n, o, inv, err, t_min, t_max, tnear);
+#endif
+}
+
+template <>
+int wide_hit<8>(const WideBVHNode<8>& n, const float o[3], const float inv[3], const float err[3],
+                float t_min, float t_max, float tnear[8]) {
+#ifdef BVH_X86
+    if (BVH_HAS_AVX2)
+        return wide_hit_avx2(n, o, inv, err, t_min, t_max, tnear);
+#endif
+    return wide_hit_scalar(n, o, inv, err, t_min, t_max, tnear);
+}
+
+
+// N-ary BVH collapsed from a binary LinearBVH. Leaves keep the primitive
+// ranges of the binary leaves, so the same leaf callback works for both.
+// Bounds are stored relative to the center of the root box, and the ray
+// origin is moved there in double before it is rounded to float, so the
+// float slab test keeps the precision of the scene's size wherever the
+// scene lies.
+template <int N>
+class WideBVH {
+public:
+    void build(const LinearBVHNode* bin, int n_bin) {
+        nodes.clear();
+        if (n_bin > 0) {
+            for (int a = 0; a < 3; ++a)
+                origin[a] = 0.5 * (double(bin[0].bmin[a]) + double(bin[0].bmax[a]));
+            collapse(bin, 0);
+        }
+    }
+
+    size_t memory() const { return nodes.size() * sizeof(WideBVHNode<N>); }
+
+    template <class Leaf>
+    bool traverse(const Ray& r, double t_min, double& t_max, Leaf leaf, bool any_hit = false) const {
+        float o[3], inv[3], err[3];
+        for (int a = 0; a < 3; ++a) {
+            o[a] = float(r.o[a] - origin[a]);
+            inv[a] = float(1 / r.d[a]);
+            // the slab distances move by the rounding of o, at most half
+            // an ulp of it, times |inv|
+            err[a] = o[a] != 0 ? FLT_EPSILON * fabsf(o[a]) * fabsf(inv[a]) : 0;
+        }
+        struct Entry { int child, count; float t; };
+        Entry stack[N * 64];
+        int sp = 0;
+        stack[sp++] = {0, 0, round_down(t_min)};
+        bool found = false;
+        while (sp > 0) {
+            Entry e = stack[--sp];
+            if (e.t > t_max)
+                continue;
+            if (e.count > 0) {
+                if (leaf(e.child, e.count, t_max)) {
+                    found = true;
+                    if (any_hit) break;
+                }
+                continue;
+            }
+            const WideBVHNode<N>& node = nodes[e.child];
+            float tnear[N];
+            int mask = wide_hit<N>(node, o, inv, err, round_down(t_min), round_up(t_max), tnear);
+            // push the children hit, farthest first, so the nearest is popped next
+            int order[N], m = 0;
+            for (int i = 0; i < N; ++i) {
+                if (!(mask >> i & 1))
+                    continue;
+                int k = m++;
+                while (k > 0 && tnear[order[k - 1]] < tnear[i]) {
+                    order[k] = order[k - 1];
+                    --k;
+                }
+                order[k] = i;
+            }
+            for (int k = 0; k < m; ++k)
+                stack[sp++] = {node.child[order[k]], node.count[order[k]], tnear[order[k]]};
+        }
+        return found;
+    }
+
+private:
+    std::vector<WideBVHNode<N>> nodes;
+    double origin[3] = {0, 0, 0};
+
+    // turns the binary subtree at `b` into wide nodes, returns the index of its root
+    int collapse(const LinearBVHNode* bin, int b) {
+        int slots[N], n = 0;
+        if (bin[b].n_prims > 0) {
+            slots[n++] = b;
+        } else {
+            slots[n++] = b + 1;
+            slots[n++] = bin[b].offset;
+        }
+        // open the largest interior child until all N slots are used
+        while (n < N) {
+            int best = -1;
+            double best_area = -1;
+            for (int i = 0; i < n; ++i) {
+                if (bin[slots[i]].n_prims == 0 && bvh_node_area(bin[slots[i]]) > best_area) {
+                    best = i;
+                    best_area = bvh_node_area(bin[slots[i]]);
+                }
+            }
+            if (best < 0)
+                break;
+            int c = slots[best];
+            slots[best] = c + 1;
+            slots[n++] = bin[c].offset;
+        }
+        int idx = int(nodes.size());
+        nodes.push_back(WideBVHNode<N>());
+        WideBVHNode<N> node;
+        node.n_children = n;
+        for (int i = 0; i < N; ++i) {
+            for (int a = 0; a < 3; ++a) {
+                node.bmin[a][i] = i < n ? round_down(bin[slots[i]].bmin[a] - origin[a]) : 0;
+                node.bmax[a][i] = i < n ? round_up(bin[slots[i]].bmax[a] - origin[a]) : 0;
+            }
+            node.child[i] = 0;
+            node.count[i] = 0;
+        }
+        for (int i = 0; i < n; ++i) {
+            const LinearBVHNode& c = bin[slots[i]];
+            if (c.n_prims > 0) {
+                node.child[i] = c.offset;
+                node.count[i] = c.n_prims;
+            } else {
+                node.child[i] = collapse(bin, slots[i]);
+            }
+        }
+        nodes[idx] = node;
+        return idx;
+    }
+};
+
+
+// Nodes of one BVH in the layout selected by BVHOptions::layout. The
+// binary nodes always exist, they are what the builder and the cache
+// produce; wide layouts are collapsed from them.
+class BVHNodes {
+public:
+    // takes the nodes returned by bvh_build_linear
+    void init(std::vector<LinearBVHNode>&& built, BVHLayout layout_) {
+        storage = std::move(built);
+        init(storage.data(), int(storage.size()), layout_);
+    }
+    // uses nodes owned elsewhere, which must outlive this
+    void init(const LinearBVHNode* nodes_, int n_nodes_, BVHLayout layout_) {
+        nodes = nodes_;
+        n_nodes = n_nodes_;
+        layout = layout_;
+        if (layout == BVH_WIDE4)
+            wide4.build(nodes, n_nodes);
+        else if (layout == BVH_WIDE8)
+            wide8.build(nodes, n_nodes);
+    }
+
+    template <class Leaf>
+    bool traverse(const Ray& r, double t_min, double& t_max, Leaf leaf, bool any_hit = false) const {
+        if (n_nodes == 0)
+            return false;
+        if (layout == BVH_WIDE4)
+            return wide4.traverse(r, t_min, t_max, leaf, any_hit);
+        if (layout == BVH_WIDE8)
+            return wide8.traverse(r, t_min, t_max, leaf, any_hit);
+        return bvh_traverse(nodes, r, t_min, t_max, leaf, any_hit);
+    }
+
+    // packets always walk the binary nodes
+    template <class Leaf>
+    void traverse_packet(RayPacket& p, int first, Leaf leaf) const {
+        if (n_nodes > 0)
+            bvh_traverse_packet(nodes, p, first, leaf);
+    }
+
+    size_t memory() const {
+        return size_t(n_nodes) * sizeof(LinearBVHNode) + wide4.memory() + wide8.memory();
+    }
+
+    const LinearBVHNode* nodes = nullptr;
+    int n_nodes = 0;
+    BVHLayout layout = BVH_LINEAR;
+
+private:
+    std::vector<LinearBVHNode> storage;
+    WideBVH<4> wide4;
+    WideBVH<8> wide8;
+};
+
+
+// BVH over arbitrary objects, packed into one contiguous array of nodes.
+class LinearBVH: public Object {
+public:
+    LinearBVH(const std::vector<Object*>& sl, double t0, double t1,
+              const BVHOptions& opt = BVHOptions()) {
+        if (sl.empty())
+            return;
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<BVHPrimitive> prims(sl.size());
+#pragma omp parallel for
+        for (int i = 0; i < (int) sl.size(); ++i) {
+            prims[i].obj = sl[i];
+            prims[i].index = i;
+            if (!sl[i]->bounding_box(t0, t1, prims[i].box))
+                fprintf(stderr, "No bounding box in LinearBVH constructor.\n");
+            prims[i].centroid = prims[i].box.centroid();
+        }
+        bvh.init(bvh_build_linear(prims, opt), opt.layout);
+        objs.resize(prims.size());
+        for (int i = 0; i < (int) prims.size(); ++i)
+            objs[i] = prims[i].obj;
+        build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    virtual bool intersect(const Ray& r, double t_min, double t_max, Hit& hit) const override {
+        return bvh.traverse(r, t_min, t_max, [&](int offset, int n, double& t_max) {
+            bool found = false;
+            for (int i = offset; i < offset + n; ++i) {
+                if (objs[i]->intersect(r, t_min, t_max, hit)) {
+                    found = true;
+                    t_max = hit.t;
+                }
+            }
+            return found;
+        });
+    }
+
+    virtual bool occluded(const Ray& r, double t_min, double t_max) const override {
+        return bvh.traverse(r, t_min, t_max, [&](int offset, int n, double& t_max) {
+            for (int i = offset; i < offset + n; ++i)
+                if (objs[i]->occluded(r, t_min, t_max))
+                    return true;
+            return false;
+        }, true);
+    }
+
+    virtual void intersect_packet(RayPacket& p, int first) const override {
+        bvh.traverse_packet(p, first, [&](const LinearBVHNode& node, int first, const double*, const double*) {
+            for (int i = node.offset; i < node.offset + node.n_prims; ++i)
+                objs[i]->intersect_packet(p, first);
+        });
+    }
+
     virtual bool bounding_box(double t0, double t1, AABB& box) const override {
-        box = nbox;
+        if (bvh.n_nodes == 0)
+            return false;
+        box = bvh_root_box(bvh.nodes);
         return true;
     }
 
-    Object *lc, *rc;
-    AABB nbox;
-};
+    double cost(double leaf_cost) const { return bvh_cost(bvh.nodes, leaf_cost); }
+    int size() const { return int(objs.size()); }
 
-int BVH_node::count = 0;
+    double build_time = 0;  // seconds
+
+private:
+    BVHNodes bvh;
+    std::vector<Object*> objs;  // in leaf order
+};
 
 #endif
\ No newline at end of file
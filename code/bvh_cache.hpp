@@ -0,0 +1,149 @@
+#ifndef __BVH_CACHE_H__
+#define __BVH_CACHE_H__
+
+#include "bvh.hpp"
+#include "mesh.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// On-disk cache of mesh BVHs. A cache file holds the flattened nodes, the
+// transformed vertices and the triangle indices in leaf order, so a
+// TriangleMesh can use the mapped file directly without parsing, building
+// or copying.
+//
+// file layout: BVHCacheHeader | nodes | vertices | triangles
+
+const char BVH_CACHE_MAGIC[8] = "RTBVH03";
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint64_t key;
+    int n_nodes, n_verts, n_tris, pad;
+};
+static_assert(sizeof(BVHCacheHeader) == 32, "nodes must stay 32 byte aligned");
+
+struct MeshCache {
+    const LinearBVHNode* nodes = nullptr;
+    const Vec3* v = nullptr;
+    const Mesh::TriangleIndex* t = nullptr;
+    int n_nodes = 0, n_verts = 0, n_tris = 0;
+};
+
+// FNV-1a
+uint64_t hash_bytes(const void* data, size_t len, uint64_t h = 14695981039346656037ull) {
+    const unsigned char* p = (const unsigned char*) data;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Hashes the contents of a file on into h. Returns false if the file
+// cannot be read.
+bool hash_file(const char* filename, uint64_t& h) {
+    FILE* f = fopen(filename, "rb");
+    if (f == nullptr)
+        return false;
+    char buf[1 << 16];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+        h = hash_bytes(buf, len, h);
+    fclose(f);
+    return true;
+}
+
+// Key of a mesh: its obj contents, transform and build options.
+// Returns false if the obj file cannot be read.
+bool mesh_cache_key(const char* filename, const Vec3& center, const Vec3& scale, double ry,
+                    const BVHOptions& opt, uint64_t& key) {
+    uint64_t h = hash_bytes(BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC));
+    if (!hash_file(filename, h))
+        return false;
+    double params[7] = {center.x, center.y, center.z, scale.x, scale.y, scale.z, ry};
+    h = hash_bytes(params, sizeof(params), h);
+    int build[3] = {int(opt.builder), opt.bins, opt.max_leaf};
+    h = hash_bytes(build, sizeof(build), h);
+    h = hash_bytes(&opt.leaf_cost, sizeof(opt.leaf_cost), h);
+    key = h;
+    return true;
+}
+
+std::string mesh_cache_path(const std::string& dir, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long) key);
+    return dir + "/" + name;
+}
+
+// Maps a cache file read-only. The mapping is never released, the mesh
+// reads from it for the lifetime of the scene.
+bool load_mesh_cache(const std::string& path, uint64_t key, MeshCache& cache) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(BVHCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    const BVHCacheHeader* header = (const BVHCacheHeader*) data;
+    size_t expected = sizeof(BVHCacheHeader) + size_t(header->n_nodes) * sizeof(LinearBVHNode)
+                    + size_t(header->n_verts) * sizeof(Vec3)
+                    + size_t(header->n_tris) * sizeof(Mesh::TriangleIndex);
+    if (memcmp(header->magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC)) != 0
+        || header->key != key || size_t(st.st_size) != expected) {
+        munmap(data, st.st_size);
+        return false;
+    }
+    const char* p = (const char*) data + sizeof(BVHCacheHeader);
+    cache.n_nodes = header->n_nodes;
+    cache.n_verts = header->n_verts;
+    cache.n_tris = header->n_tris;
+    cache.nodes = (const LinearBVHNode*) p;
+    p += size_t(cache.n_nodes) * sizeof(LinearBVHNode);
+    cache.v = (const Vec3*) p;
+    p += size_t(cache.n_verts) * sizeof(Vec3);
+    cache.t = (const Mesh::TriangleIndex*) p;
+    return true;
+}
+
+// Writes to a temporary file first and renames it, so concurrent renders
+// never map a half written cache.
+bool save_mesh_cache(const std::string& dir, const std::string& path, uint64_t key,
+                     const TriangleMesh& mesh) {
+    mkdir(dir.c_str(), 0755);
+    std::string tmp = path + ".tmp" + std::to_string(getpid());
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (f == nullptr)
+        return false;
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC));
+    header.key = key;
+    header.n_nodes = mesh.bvh.n_nodes;
+    header.n_verts = mesh.n_verts;
+    header.n_tris = mesh.n_tris;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+           && fwrite(mesh.bvh.nodes, sizeof(LinearBVHNode), mesh.bvh.n_nodes, f) == size_t(mesh.bvh.n_nodes)
+           && fwrite(mesh.v, sizeof(Vec3), mesh.n_verts, f) == size_t(mesh.n_verts)
+           && fwrite(mesh.t, sizeof(Mesh::TriangleIndex), mesh.n_tris, f) == size_t(mesh.n_tris);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
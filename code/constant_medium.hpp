@@ -8,23 +8,74 @@
 
 const double infi = std::numeric_limits<double>::infinity();
 
-class ConstantMedium : public Object  {
+// Uniforms for free-flight sampling, which may need any number of them.
+// They are hashed from the path's sample, its current dimension and the
+// medium's id, and take no dimension of the path: a ray may cross any
+// number of media, and the draws of a bounce must stay in its block.
+class MediumRandom {
+    public:
+        MediumRandom(const Sampler &sampler, int medium) : seed(sampler.stream_seed(uint64_t(medium))) {}
+
+        double next() { return hash_uniform(seed, n++); }
+
+    private:
+        uint64_t seed;
+        int n = 0;
+};
+
+// Participating media. A ray scatters inside at a distance intersect
+// samples; shadow rays pass through instead, and the tracer weights
+// their light by the transmittance of every medium of the scene (see
+// PathTracer::visibility).
+class Medium : public Object {
+    public:
+        // estimate of the fraction of light that crosses (t_min, t_max)
+        virtual double transmittance(const Ray& r, double t_min, double t_max) const = 0;
+
+        virtual bool occluded(const Ray& r, double t_min, double t_max) const override {
+            return false;
+        }
+};
+
+class ConstantMedium : public Medium  {
     public:
         ConstantMedium(Object* b, double d, Texture* a)
             : boundary(b),
-              neg_inv_density(-1/d),
-              phaseFunc(new Isotropic(a))
+              phaseFunc(new Isotropic(a)),
+              density(d),
+              neg_inv_density(-1/d)
             {}
 
         ConstantMedium(Object* b, double d, Vec3 color)
             : boundary(b),
-              neg_inv_density(-1/d),
-              phaseFunc(new Isotropic(color))
+              phaseFunc(new Isotropic(color)),
+              density(d),
+              neg_inv_density(-1/d)
             {}
 
         virtual bool intersect(
             const Ray& r, double t_min, double t_max, Hit& rec) const override;
 
+        // in closed form, exp(-density * length inside)
+        virtual double transmittance(const Ray& r, double t_min, double t_max) const override {
+            Crossings c;
+            boundary_crossings(r, c);
+            double length = 0;
+            for (int i = 0; i + 1 < c.n; i += 2) {
+                double t0, t1;
+                if (clip(c, i, t_min, t_max, t0, t1))
+                    length += t1 - t0;
+            }
+            return exp(-density * length);
+        }
+
+        virtual void get_surface(const Ray& r, Hit& rec) const override {
+            rec.p = r.point(rec.t);
+            rec.norm = r.direction() * -1;  // arbitrary, facing the ray for the feature buffers
+            rec.material = phaseFunc;
+            rec.u = rec.v = 0.0;
+        }
+
         virtual bool bounding_box(double time0, double time1, AABB& output_box) const override {
             return boundary->bounding_box(time0, time1, output_box);
         }
@@ -32,54 +83,61 @@ class ConstantMedium : public Object  {
     public:
         Object* boundary;
         Material* phaseFunc;
+        double density;
         double neg_inv_density;
-};
 
+    private:
+        // A line that crosses the boundary more often than Crossings keeps
+        // falls back to taking it as convex, from the first hit to the next.
+        void boundary_crossings(const Ray& r, Crossings& c) const {
+            boundary->crossings(r, c);
+            if (!c.overflow)
+                return;
+            Hit rec1, rec2;
+            c.n = 0;
+            if (boundary->intersect(r, -infi, infi, rec1) && boundary->intersect(r, rec1.t+0.0001, infi, rec2)) {
+                c.t[c.n++] = rec1.t;
+                c.t[c.n++] = rec2.t;
+            }
+        }
 
-bool ConstantMedium::intersect(const Ray& r, double t_min, double t_max, Hit& rec) const {
-    // Print occasional samples when debugging. To enable, set enableDebug true.
-    const bool enableDebug = false;
-    const bool debugging = enableDebug && drand48() < 0.00001;
-
-    Hit rec1, rec2;
-
-    if (!boundary->intersect(r, -infi, infi, rec1))
-        return false;
-
-    if (!boundary->intersect(r, rec1.t+0.0001, infi, rec2))
-        return false;
-
-    if (debugging) fprintf(stderr, "\nt_min=%lf, t_max=%lf\n", rec1.t, rec2.t);
-
-    if (rec1.t < t_min) rec1.t = t_min;
-    if (rec2.t > t_max) rec2.t = t_max;
-
-    if (rec1.t >= rec2.t)
-        return false;
+        // the part of (t_min, t_max) inside the boundary between crossings
+        // i and i + 1
+        static bool clip(const Crossings& c, int i, double t_min, double t_max, double& t0, double& t1) {
+            t0 = fmax(t_min, fmax(c.t[i], 0.0));
+            t1 = fmin(t_max, c.t[i + 1]);
+            return t0 < t1;
+        }
+};
 
-    if (rec1.t < 0)
-        rec1.t = 0;
 
+// The boundary's crossings come from a single query; a distance is drawn
+// once and walked through the spans of the ray that lie inside, so a
+// boundary that is not convex is handled too.
+bool ConstantMedium::intersect(const Ray& r, double t_min, double t_max, Hit& rec) const {
+    Crossings c;
+    boundary_crossings(r, c);
+    MediumRandom random(*r.sampler, id);
     const auto ray_length = r.direction().len();
-    const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-    const auto hit_distance = neg_inv_density * log(drand48());
-
-    if (hit_distance > distance_inside_boundary)
-        return false;
-
-    rec.t = rec1.t + hit_distance / ray_length;
-    rec.p = r.point(rec.t);
-
-    if (debugging) {
-        fprintf(stderr, "hit_distance = %lf\n", hit_distance);
-        fprintf(stderr, "rec.t = %lf\n", rec.t);
-        fprintf(stderr, "rec.p = %lf %f %f\n", rec.p.x, rec.p.y, rec.p.z);
+    bool drawn = false;
+    double hit_distance = 0;
+    for (int i = 0; i + 1 < c.n; i += 2) {
+        double t0, t1;
+        if (!clip(c, i, t_min, t_max, t0, t1))
+            continue;
+        if (!drawn) {
+            hit_distance = neg_inv_density * log(random.next());
+            drawn = true;
+        }
+        const auto distance_inside_boundary = (t1 - t0) * ray_length;
+        if (hit_distance <= distance_inside_boundary) {
+            rec.t = t0 + hit_distance / ray_length;
+            rec.obj = this;
+            return true;
+        }
+        hit_distance -= distance_inside_boundary;
     }
-
-    rec.norm = Vec3(1,0,0);  // arbitrary
-    rec.material = phaseFunc;
-
-    return true;
+    return false;
 }
 
-#endif
\ No newline at end of file
+#endif
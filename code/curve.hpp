@@ -204,18 +204,27 @@ public:
             t > t_max)
             return false;
         h.t = t;
-        h.p = r.point(t);
+        h.obj = this;
+        h.b1 = theta;
+        h.b2 = mu;
+        // fprintf(stderr, "[Bezier] intersect\n");
+        return true;
+    }
+
+    virtual void get_surface(const Ray &r, Hit &h) const override {
+        // the normal Newton's method converged with, at the (theta, mu) it returned
+        Vec3 dtheta, dmu;
+        getPoint(h.b1, h.b2, dtheta, dmu);
+        h.p = r.point(h.t);
         h.material = this->material;
         // double theta_prime = atan2(-normal.z, normal.x) + PI;
         // if (int(fabs(theta - theta_prime)/PI) % 2 == 1){
         //     normal = Vec3() - normal;
         //     fprintf(stderr, "%lf\n", theta_prime - theta);
         // }
-        h.norm = normal.normalized();
-        h.u = theta / (2 *PI);
-        h.v = mu;
-        // fprintf(stderr, "[Bezier] intersect\n");
-        return true;
+        h.norm = (dmu % dtheta).normalized();
+        h.u = h.b1 / (2 *PI);
+        h.v = h.b2;
     }
 
     virtual bool bounding_box(double t0, double t1, AABB& box) const override{
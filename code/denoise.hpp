@@ -0,0 +1,138 @@
+#ifndef __DENOISE_H__
+#define __DENOISE_H__
+
+#include "utils.hpp"
+#include "film.hpp"
+#include "image.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Edge-avoiding A-trous wavelet filter (Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering"). A
+// 5x5 B3 spline kernel is applied a few times with its taps spread twice
+// as far each time, and every tap is weighted down where the guide
+// buffers of the film differ: normal, depth (against the local depth
+// slope) and albedo. The luminance weight is scaled by the noise of the
+// pixel, estimated from its sample variance and filtered along with the
+// color, as in SVGF (Schied et al. 2017).
+//
+// The filter runs on the color divided by the albedo, so textures stay
+// sharp and only the illumination is blurred.
+struct DenoiseOptions
+{
+    int iterations = 4;
+    double sigma_luminance = 2;  // in standard deviations of the noise
+    double sigma_normal = 128;   // exponent of the cosine between normals
+    double sigma_depth = 1;      // in steps of the local depth slope
+    double sigma_albedo = 0.1;
+};
+
+// denoised colors of the film, row by row
+std::vector<Vec3> denoise(const Film &film, const DenoiseOptions &opt = DenoiseOptions())
+{
+    const int w = film.width, h = film.height;
+    const double eps = 0.01;  // keeps black albedo from dividing by zero
+    const double kernel[3] = {3.0 / 8, 1.0 / 4, 1.0 / 16};
+    std::vector<Vec3> color(size_t(w) * h), albedo(color.size()), normal(color.size());
+    std::vector<double> depth(color.size()), slope(color.size()), var(color.size());
+#pragma omp parallel for
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x)
+        {
+            int i = y * w + x;
+            albedo[i] = film.albedo(x, y) + Vec3(eps, eps, eps);
+            Vec3 c = film.pixel(x, y);
+            color[i] = Vec3(c.x / albedo[i].x, c.y / albedo[i].y, c.z / albedo[i].z);
+            Vec3 n = film.normal(x, y);
+            normal[i] = n.len() > 0 ? n.normalized() : n;
+            depth[i] = film.depth(x, y);
+            // noise of the illumination rather than of the color
+            double a = Film::luminance(albedo[i]);
+            var[i] = std::min(film.variance(x, y), 1e30) / (a * a);
+        }
+#pragma omp parallel for
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x)
+        {
+            double dx = depth[y * w + std::min(x + 1, w - 1)] - depth[y * w + std::max(x - 1, 0)];
+            double dy = depth[std::min(y + 1, h - 1) * w + x] - depth[std::max(y - 1, 0) * w + x];
+            slope[y * w + x] = 0.5 * std::max(fabs(dx), fabs(dy));
+        }
+    std::vector<Vec3> next_color(color.size());
+    std::vector<double> next_var(var.size()), blurred_var(var.size());
+    for (int it = 0, step = 1; it < opt.iterations; ++it, step *= 2)
+    {
+        // the luminance weight uses the variance blurred over 3x3 pixels,
+        // a single pixel's estimate is itself too noisy
+#pragma omp parallel for
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x)
+            {
+                double sum = 0, weight = 0;
+                for (int v = -1; v <= 1; ++v)
+                    for (int u = -1; u <= 1; ++u)
+                    {
+                        int qx = x + u, qy = y + v;
+                        if (qx < 0 || qx >= w || qy < 0 || qy >= h)
+                            continue;
+                        double k = (u ? 0.25 : 0.5) * (v ? 0.25 : 0.5);
+                        sum += k * var[qy * w + qx];
+                        weight += k;
+                    }
+                blurred_var[y * w + x] = sum / weight;
+            }
+#pragma omp parallel for schedule(dynamic, 4)
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x)
+            {
+                int p = y * w + x;
+                double lum_p = Film::luminance(color[p]);
+                double lum_scale = opt.sigma_luminance * sqrt(blurred_var[p]) + 1e-4;
+                Vec3 sum;
+                double weight = 0, var_sum = 0;
+                for (int v = -2; v <= 2; ++v)
+                    for (int u = -2; u <= 2; ++u)
+                    {
+                        int qx = x + u * step, qy = y + v * step;
+                        if (qx < 0 || qx >= w || qy < 0 || qy >= h)
+                            continue;
+                        int q = qy * w + qx;
+                        double k = kernel[abs(u)] * kernel[abs(v)];
+                        if (q != p)
+                        {
+                            double cosine = normal[p].dot(normal[q]);
+                            bool no_normals = normal[p].len() == 0 && normal[q].len() == 0;
+                            double w_normal = no_normals ? 1 : pow(std::max(0.0, cosine), opt.sigma_normal);
+                            double dist = step * sqrt(double(u * u + v * v));
+                            double w_depth = fabs(depth[p] - depth[q])
+                                             / (opt.sigma_depth * slope[p] * dist + 1e-6 * (1 + depth[p]));
+                            double w_albedo = (albedo[p] - albedo[q]).len2() / (opt.sigma_albedo * opt.sigma_albedo);
+                            double w_lum = fabs(lum_p - Film::luminance(color[q])) / lum_scale;
+                            k *= w_normal * exp(-w_depth - w_albedo - w_lum);
+                        }
+                        sum += color[q] * k;
+                        weight += k;
+                        var_sum += k * k * var[q];
+                    }
+                next_color[p] = sum / weight;
+                next_var[p] = var_sum / (weight * weight);
+            }
+        color.swap(next_color);
+        var.swap(next_var);
+    }
+    for (size_t i = 0; i < color.size(); ++i)
+        color[i] = color[i].mult(albedo[i]).clip();
+    return color;
+}
+
+// the denoised film as an image
+void develop_denoised(const Film &film, Image &image, const DenoiseOptions &opt = DenoiseOptions())
+{
+    std::vector<Vec3> color = denoise(film, opt);
+    for (int y = 0; y < film.height; ++y)
+        for (int x = 0; x < film.width; ++x)
+            image.setPixel(x, y, color[y * film.width + x]);
+}
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef __FILM_H__
+#define __FILM_H__
+
+#include "utils.hpp"
+#include "image.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Buffers a render can write besides the color, see Film::develop_aov.
+enum AOV { AOV_DEPTH, AOV_NORMAL, AOV_ALBEDO, AOV_MATERIAL, AOV_OBJECT, AOV_SPP };
+
+inline bool parse_aov(const char *name, AOV &aov)
+{
+    const char *names[] = {"depth", "normal", "albedo", "material", "object", "spp"};
+    for (int i = 0; i < 6; ++i)
+        if (!strcmp(name, names[i]))
+        {
+            aov = AOV(i);
+            return true;
+        }
+    return false;
+}
+
+// a color per id, hashed so that neighbouring ids differ; 0 is black
+inline Vec3 id_color(int id)
+{
+    if (id == 0)
+        return Vec3();
+    uint32_t h = uint32_t(id) * 0x9e3779b1u;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return Vec3(h & 255, h >> 8 & 255, h >> 16 & 255) / 255.0;
+}
+
+// Samples accumulated by a render. Every pixel is split into 2x2
+// subpixels whose means are clipped separately and then averaged. Samples
+// come in rounds of one sample per subpixel; next to the sums the film
+// keeps a running mean and variance (Welford) of the luminance of each
+// round, from which adaptive sampling estimates the noise left in a pixel,
+// and the mean albedo, normal and depth of the first hits, which guide the
+// denoiser.
+class Film
+{
+public:
+    static const int SUBPIXELS = 4;
+
+    Film(int w, int h) : width(w), height(h), sums(size_t(w) * h * SUBPIXELS),
+                         rounds(size_t(w) * h), mean(size_t(w) * h), m2(size_t(w) * h),
+                         albedo_sums(size_t(w) * h), normal_sums(size_t(w) * h), depth_sums(size_t(w) * h),
+                         material_ids(size_t(w) * h), object_ids(size_t(w) * h) {}
+
+    // one sample of each subpixel of (x, y), in the order sy * 2 + sx
+    void add_round(int x, int y, const Vec3 *colors)
+    {
+        int i = y * width + x;
+        double lum = 0;
+        for (int s = 0; s < SUBPIXELS; ++s)
+        {
+            sums[i * SUBPIXELS + s] += colors[s];
+            lum += luminance(colors[s]) / SUBPIXELS;
+        }
+        int n = ++rounds[i];
+        double delta = lum - mean[i];
+        mean[i] += delta / n;
+        m2[i] += delta * (lum - mean[i]);
+    }
+
+    // Features of the first hits of a round, averaged over its subpixels;
+    // added once per round after add_round. Ids cannot be averaged, the
+    // pixel keeps those of its first round.
+    void add_features(int x, int y, const Vec3 &albedo, const Vec3 &normal, double depth,
+                      int material_id, int object_id)
+    {
+        int i = y * width + x;
+        albedo_sums[i] += albedo;
+        normal_sums[i] += normal;
+        depth_sums[i] += depth;
+        if (rounds[i] == 1)
+        {
+            material_ids[i] = material_id;
+            object_ids[i] = object_id;
+        }
+    }
+
+    int samples(int x, int y) const { return rounds[y * width + x] * SUBPIXELS; }
+
+    // variance of the mean luminance of the pixel
+    double variance(int x, int y) const
+    {
+        int i = y * width + x, n = rounds[i];
+        return n < 2 ? INFINITY : m2[i] / (n - 1) / n;
+    }
+
+    // Standard error of the pixel mean relative to its brightness; the
+    // offset keeps dark pixels from chasing noise that does not show.
+    double relative_error(int x, int y) const
+    {
+        return sqrt(variance(x, y)) / (mean[y * width + x] + 0.1);
+    }
+
+    Vec3 pixel(int x, int y) const
+    {
+        int i = y * width + x;
+        if (rounds[i] == 0)
+            return Vec3();
+        Vec3 color;
+        for (int s = 0; s < SUBPIXELS; ++s)
+            color += (sums[i * SUBPIXELS + s] / rounds[i]).clip() / SUBPIXELS;
+        return color;
+    }
+
+    Vec3 albedo(int x, int y) const
+    {
+        int i = y * width + x;
+        return rounds[i] ? albedo_sums[i] / rounds[i] : Vec3();
+    }
+    // mean normal, not renormalized; shorter where the pixel straddles an edge
+    Vec3 normal(int x, int y) const
+    {
+        int i = y * width + x;
+        return rounds[i] ? normal_sums[i] / rounds[i] : Vec3();
+    }
+    double depth(int x, int y) const
+    {
+        int i = y * width + x;
+        return rounds[i] ? depth_sums[i] / rounds[i] : 0;
+    }
+
+    void develop(Image &image) const
+    {
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+                image.setPixel(x, y, pixel(x, y));
+    }
+
+    // One of the feature buffers. `raw` keeps the values as they are, for
+    // float images; otherwise they are mapped to [0, 1] for viewing:
+    // depth and sample counts over their maximum, normals from [-1, 1],
+    // and ids to distinct colors.
+    void develop_aov(Image &image, AOV aov, bool raw) const
+    {
+        double max_depth = 0;
+        int max_spp = 1;
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+            {
+                max_depth = fmax(max_depth, depth(x, y));
+                max_spp = std::max(max_spp, samples(x, y));
+            }
+        if (aov == AOV_SPP)
+        {
+            develop_spp(image, max_spp, raw);
+            return;
+        }
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+            {
+                int i = y * width + x;
+                Vec3 c;
+                switch (aov)
+                {
+                case AOV_DEPTH:
+                    c = Vec3(1, 1, 1) * (raw || max_depth == 0 ? depth(x, y) : depth(x, y) / max_depth);
+                    break;
+                case AOV_NORMAL:
+                {
+                    Vec3 n = normal(x, y);
+                    if (n.len() > 0)
+                        c = raw ? n.normalized() : n.normalized() * 0.5 + Vec3(0.5, 0.5, 0.5);
+                    break;
+                }
+                case AOV_ALBEDO:
+                    c = albedo(x, y);
+                    break;
+                case AOV_MATERIAL:
+                case AOV_OBJECT:
+                {
+                    int id = aov == AOV_MATERIAL ? material_ids[i] : object_ids[i];
+                    c = raw ? Vec3(id, id, id) : id_color(id);
+                    break;
+                }
+                case AOV_SPP:
+                    break;
+                }
+                image.setPixel(x, y, c);
+            }
+    }
+
+    // samples per pixel as gray levels, white at max_spp, or the counts
+    // themselves if raw
+    void develop_spp(Image &image, int max_spp, bool raw = false) const
+    {
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+            {
+                double level = raw ? samples(x, y) : clamp(double(samples(x, y)) / max_spp);
+                image.setPixel(x, y, Vec3(level, level, level));
+            }
+    }
+
+    long long total_samples() const
+    {
+        long long n = 0;
+        for (int r : rounds)
+            n += r;
+        return n * SUBPIXELS;
+    }
+
+    static double luminance(const Vec3 &c) { return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z; }
+
+    // raw sums and statistics, for checkpoints
+    bool write(FILE *f) const
+    {
+        return write_all(f, sums) && write_all(f, rounds) && write_all(f, mean) && write_all(f, m2)
+            && write_all(f, albedo_sums) && write_all(f, normal_sums) && write_all(f, depth_sums)
+            && write_all(f, material_ids) && write_all(f, object_ids);
+    }
+    bool read(FILE *f)
+    {
+        return read_all(f, sums) && read_all(f, rounds) && read_all(f, mean) && read_all(f, m2)
+            && read_all(f, albedo_sums) && read_all(f, normal_sums) && read_all(f, depth_sums)
+            && read_all(f, material_ids) && read_all(f, object_ids);
+    }
+
+    int width, height;
+
+private:
+    std::vector<Vec3> sums;
+    std::vector<int> rounds;
+    std::vector<double> mean, m2;
+    std::vector<Vec3> albedo_sums, normal_sums;
+    std::vector<double> depth_sums;
+    std::vector<int> material_ids, object_ids;
+
+    template <class T>
+    static bool write_all(FILE *f, const std::vector<T> &v)
+    {
+        return fwrite(v.data(), sizeof(T), v.size(), f) == v.size();
+    }
+    template <class T>
+    static bool read_all(FILE *f, std::vector<T> &v)
+    {
+        return fread(v.data(), sizeof(T), v.size(), f) == v.size();
+    }
+};
+
+// What a render needs besides the film to go on where it stopped. The
+// samplers keep no state: their numbers are a function of the seed,
+// pixel, sample index and dimension, and the next sample index of a pixel
+// is the number of rounds it has, so the type and seed are enough. The
+// stratified sampler also lays its strata out for the sample count of
+// the render, which is kept so that a resume to another count, which
+// would reuse strata, can be refused. The options that change what a
+// sample estimates and a hash of the scene file are kept for the same
+// reason: the film would average two different images.
+struct Checkpoint
+{
+    int32_t width, height;
+    int32_t rounds_done;    // rounds of the last finished pass
+    int32_t sampler_type;
+    int32_t sampler_spp;    // target rounds per pixel
+    int32_t nee;
+    int32_t light_sampling;
+    int32_t min_spp;
+    double adaptive;
+    uint64_t seed;
+    uint64_t scene_hash;
+};
+// written raw, so it must have no padding for the files to be deterministic
+static_assert(sizeof(Checkpoint) == 8 * 4 + 3 * 8, "Checkpoint has padding");
+
+const char CHECKPOINT_MAGIC[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '4'};
+
+// Written next to the target and renamed over it, so a render killed
+// while saving keeps its previous checkpoint.
+inline bool save_checkpoint(const char *path, const Checkpoint &c, const Film &film)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == nullptr)
+        return false;
+    bool ok = fwrite(CHECKPOINT_MAGIC, 1, 8, f) == 8 && fwrite(&c, sizeof(c), 1, f) == 1 && film.write(f);
+    ok = fclose(f) == 0 && ok;
+    return ok && rename(tmp.c_str(), path) == 0;
+}
+
+// fails on a file that is not a checkpoint or has another image size
+inline bool load_checkpoint(const char *path, Checkpoint &c, Film &film)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr)
+        return false;
+    char magic[8];
+    bool ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, CHECKPOINT_MAGIC, 8) == 0
+              && fread(&c, sizeof(c), 1, f) == 1
+              && c.width == film.width && c.height == film.height && film.read(f);
+    fclose(f);
+    return ok;
+}
+
+#endif
@@ -166,14 +166,15 @@ ObjectList perlin_scene()
 Vec3 get_color(const Ray &r, Object *objs, Vec3 bg, int depth)
 {
     Hit hit;
-    if (objs->intersect(r, 0.001, MAX_double, hit))
+    if (objs->closest_hit(r, 0.001, MAX_double, hit))
     {
         Ray s_ray;
         Vec3 dir = r.direction();
         // fprintf(stderr ,"%f %f %F\n", dir.x, dir.y, dir.z);
         Vec3 attenuation;
+        double pdf;
         Vec3 illuminated = hit.material->illuminate(hit.u, hit.v, hit.p);
-        if (depth > 0 && hit.material->scatter(r, hit, attenuation, s_ray))
+        if (depth > 0 && hit.material->scatter(r, hit, attenuation, s_ray, pdf))
         {
             Vec3 new_color = get_color(s_ray, objs, bg, depth - 1).mult(attenuation);
             return new_color + illuminated;
@@ -211,6 +212,9 @@ int main(int argc, char **argv)
     // ObjectList* world = &perlin_scene();
     // ObjectList* world = parser.getGroup();
     Camera* camera = getCam(w, h);
+    BVHOptions bvh_options;
+    bvh_options.builder = BVH_SAH;
+    LinearBVH scene(world.getList(), camera->time0, camera->time1, bvh_options);
 
     Vec3 color;
 #pragma omp parallel for schedule(dynamic, 1) private(color) // OpenMP
@@ -220,18 +224,23 @@ int main(int argc, char **argv)
         fprintf(stderr, "\rRendering (%d spp) %5.2f%%", samps, 100. * y / (h - 1));
         for (unsigned short x = 0; x < w; x++)
         { // Loop cols
+            SobolSampler sampler;
+            sampler.start_pixel(uint64_t(y) * w + x);
             color = Vec3();
             // fprintf(stderr, "start looping x%d y%d\n", x, y);
             for (int s = 0; s < samps; s++)
             {
-                double u = double(x + drand48()) / double(w - 1);
-                double v = double(y + drand48()) / double(h - 1);
+                sampler.start_sample(s);
+                double dx, dy;
+                sampler.next_2d(dx, dy);
+                double u = double(x + dx) / double(w - 1);
+                double v = double(y + dy) / double(h - 1);
                 // fprintf(stderr, "\nstart_ray");
-                Ray ray = camera->generate_ray(u, v);
+                Ray ray = camera->generate_ray(u, v, sampler);
                 // fprintf(stderr, "origin %f %f %f, dir %f %f %f\n", ray.o.x, ray.o.y, ray.o.z, ray.d.x, ray.d.y, ray.d.z);
                 // fprintf(stderr, "\nfinish_ray");
                 
-                color += get_color(ray, &world, Vec3(1,1, 1.0), max_depth);
+                color += get_color(ray, &scene, Vec3(1,1, 1.0), max_depth);
             }
             image.setPixel(x, y, color / samps);
         }
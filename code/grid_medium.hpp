@@ -0,0 +1,232 @@
+#ifndef __GRID_MEDIUM_H__
+#define __GRID_MEDIUM_H__
+
+#include "constant_medium.hpp"
+#include "bbox.hpp"
+#include "texture.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+// Medium whose density varies over a box, given on a grid of voxels and
+// interpolated trilinearly between their centers.
+//
+// Scattering distances are sampled by delta tracking and shadow rays are
+// attenuated by ratio tracking. Both take tentative collisions at the
+// rate of a majorant, an upper bound of the density, and here the bound
+// is kept per coarse cell of MAJORANT_CELL^3 voxels: a ray walks the
+// cells in order and draws collisions against each cell's own bound, so
+// empty cells cost nothing and thin ones few samples.
+class GridMedium : public Medium {
+    public:
+        static const int MAJORANT_CELL = 8;
+
+        // `values` holds nx * ny * nz voxels, x varying fastest; the density
+        // is `scale` times the interpolated value
+        GridMedium(const AABB& box_, int nx, int ny, int nz, std::vector<float> values_,
+                   double scale_, Vec3 color)
+            : box(box_), values(std::move(values_)), scale(scale_), phaseFunc(new Isotropic(color)) {
+            n[0] = nx; n[1] = ny; n[2] = nz;
+            for (int a = 0; a < 3; ++a) {
+                m[a] = (n[a] + MAJORANT_CELL - 1) / MAJORANT_CELL;
+                voxel[a] = (box.max()[a] - box.min()[a]) / n[a];
+                cell[a] = voxel[a] * MAJORANT_CELL;
+            }
+            build_majorants();
+        }
+
+        virtual bool intersect(const Ray& r, double t_min, double t_max, Hit& rec) const override {
+            if (!clip(r, t_min, t_max))
+                return false;
+            MediumRandom random(*r.sampler, id);
+            bool scattered = false;
+            march(r, t_min, t_max, [&](double t, double t_exit, double majorant) {
+                if (majorant <= 0)
+                    return true;
+                for (;;) {
+                    t -= log(1 - random.next()) / majorant;
+                    if (t >= t_exit)
+                        return true;
+                    // a real collision with probability density / majorant
+                    if (random.next() * majorant < density(r.point(t))) {
+                        rec.t = t;
+                        scattered = true;
+                        return false;
+                    }
+                }
+            });
+            if (scattered)
+                rec.obj = this;
+            return scattered;
+        }
+
+        // Ratio tracking: every tentative collision keeps the fraction of
+        // light that is not a real one. Low estimates go through Russian
+        // roulette so that dense media do not run to the far side.
+        virtual double transmittance(const Ray& r, double t_min, double t_max) const override {
+            if (!clip(r, t_min, t_max))
+                return 1;
+            MediumRandom random(*r.sampler, id);
+            double tr = 1;
+            march(r, t_min, t_max, [&](double t, double t_exit, double majorant) {
+                if (majorant <= 0)
+                    return true;
+                for (;;) {
+                    t -= log(1 - random.next()) / majorant;
+                    if (t >= t_exit)
+                        return true;
+                    tr *= 1 - density(r.point(t)) / majorant;
+                    if (tr < 0.1) {
+                        if (random.next() >= 0.5) {
+                            tr = 0;
+                            return false;
+                        }
+                        tr *= 2;
+                    }
+                }
+            });
+            return tr;
+        }
+
+        virtual void get_surface(const Ray& r, Hit& rec) const override {
+            rec.p = r.point(rec.t);
+            rec.norm = r.direction() * -1;  // arbitrary, facing the ray for the feature buffers
+            rec.material = phaseFunc;
+            rec.u = rec.v = 0.0;
+        }
+
+        virtual bool bounding_box(double time0, double time1, AABB& output_box) const override {
+            output_box = box;
+            return true;
+        }
+
+        double density(const Vec3& p) const {
+            int i0[3], i1[3];
+            double f[3];
+            for (int a = 0; a < 3; ++a) {
+                // voxel coordinates, with the centers on integers
+                double g = (p[a] - box.min()[a]) / voxel[a] - 0.5;
+                double fl = floor(g);
+                f[a] = g - fl;
+                i0[a] = std::min(std::max(int(fl), 0), n[a] - 1);
+                i1[a] = std::min(std::max(int(fl) + 1, 0), n[a] - 1);
+            }
+            double v = 0;
+            for (int c = 0; c < 8; ++c) {
+                int x = c & 1 ? i1[0] : i0[0], y = c & 2 ? i1[1] : i0[1], z = c & 4 ? i1[2] : i0[2];
+                double w = (c & 1 ? f[0] : 1 - f[0]) * (c & 2 ? f[1] : 1 - f[1]) * (c & 4 ? f[2] : 1 - f[2]);
+                v += w * values[(size_t(z) * n[1] + y) * n[0] + x];
+            }
+            return scale * v;
+        }
+
+    private:
+        AABB box;
+        std::vector<float> values;
+        double scale;
+        Material* phaseFunc;
+        int n[3], m[3];           // voxels and majorant cells per axis
+        double voxel[3], cell[3]; // their sizes
+        std::vector<double> majorants;
+
+        // The interpolated density in a cell never exceeds its voxels and
+        // their neighbours, whose values the cell's points blend.
+        void build_majorants() {
+            majorants.assign(size_t(m[0]) * m[1] * m[2], 0);
+            for (int cz = 0; cz < m[2]; ++cz)
+                for (int cy = 0; cy < m[1]; ++cy)
+                    for (int cx = 0; cx < m[0]; ++cx) {
+                        int c[3] = {cx, cy, cz}, lo[3], hi[3];
+                        for (int a = 0; a < 3; ++a) {
+                            lo[a] = std::max(c[a] * MAJORANT_CELL - 1, 0);
+                            hi[a] = std::min((c[a] + 1) * MAJORANT_CELL, n[a] - 1);
+                        }
+                        double v = 0;
+                        for (int z = lo[2]; z <= hi[2]; ++z)
+                            for (int y = lo[1]; y <= hi[1]; ++y)
+                                for (int x = lo[0]; x <= hi[0]; ++x)
+                                    v = fmax(v, values[(size_t(z) * n[1] + y) * n[0] + x]);
+                        majorants[(size_t(cz) * m[1] + cy) * m[0] + cx] = scale * v;
+                    }
+        }
+
+        // clips (t_min, t_max) to the box
+        bool clip(const Ray& r, double& t_min, double& t_max) const {
+            for (int a = 0; a < 3; ++a) {
+                double inv = 1 / r.d[a];
+                double t0 = (box.min()[a] - r.o[a]) * inv, t1 = (box.max()[a] - r.o[a]) * inv;
+                if (inv < 0)
+                    std::swap(t0, t1);
+                t_min = fmax(t_min, t0);
+                t_max = fmin(t_max, t1);
+            }
+            return t_min < t_max;
+        }
+
+        // Walks the majorant cells along r over (t_min, t_max), which lies
+        // in the box, calling visit(t_enter, t_exit, majorant) for each in
+        // order until it returns false (3D DDA).
+        template <class Visit>
+        void march(const Ray& r, double t_min, double t_max, Visit visit) const {
+            Vec3 p = r.point(t_min);
+            int c[3], step[3];
+            double next[3], delta[3];
+            for (int a = 0; a < 3; ++a) {
+                c[a] = std::min(std::max(int(floor((p[a] - box.min()[a]) / cell[a])), 0), m[a] - 1);
+                double edge = box.min()[a] + (r.d[a] > 0 ? c[a] + 1 : c[a]) * cell[a];
+                if (r.d[a] != 0) {
+                    step[a] = r.d[a] > 0 ? 1 : -1;
+                    next[a] = t_min + (edge - p[a]) / r.d[a];
+                    delta[a] = cell[a] / fabs(r.d[a]);
+                } else {
+                    step[a] = 0;
+                    next[a] = delta[a] = infi;
+                }
+            }
+            double t = t_min;
+            while (t < t_max) {
+                int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+                double t_exit = fmin(next[a], t_max);
+                if (!visit(t, t_exit, majorants[(size_t(c[2]) * m[1] + c[1]) * m[0] + c[0]]))
+                    return;
+                t = t_exit;
+                c[a] += step[a];
+                if (c[a] < 0 || c[a] >= m[a])
+                    return;
+                next[a] += delta[a];
+            }
+        }
+};
+
+// Density values of a raw file of count 32 bit floats, in the byte order
+// of the machine.
+inline bool load_density_grid(const char* path, size_t count, std::vector<float>& values) {
+    FILE* f = fopen(path, "rb");
+    if (f == nullptr)
+        return false;
+    values.resize(count);
+    bool ok = fread(values.data(), sizeof(float), count, f) == count;
+    fclose(f);
+    return ok;
+}
+
+// A puff of smoke over the box from Perlin turbulence, fading out towards
+// the faces so the medium has no hard edges; thin noise is cut to zero,
+// which leaves empty space for the majorant grid to skip.
+inline std::vector<float> noise_density_grid(const AABB& box, int nx, int ny, int nz, double frequency) {
+    Perlin noise;
+    std::vector<float> values(size_t(nx) * ny * nz);
+    Vec3 lo = box.min(), size = box.max() - box.min();
+    for (int z = 0; z < nz; ++z)
+        for (int y = 0; y < ny; ++y)
+            for (int x = 0; x < nx; ++x) {
+                Vec3 u((x + 0.5) / nx, (y + 0.5) / ny, (z + 0.5) / nz);
+                Vec3 p = lo + Vec3(u.x * size.x, u.y * size.y, u.z * size.z);
+                Vec3 c = u * 2 - Vec3(1, 1, 1);
+                double falloff = fmax(0.0, 1 - c.len2());
+                values[(size_t(z) * ny + y) * nx + x] = float(fmax(0.0, 2 * noise.turb(p * frequency) * falloff - 0.5));
+            }
+    return values;
+}
+
+#endif
@@ -74,10 +74,25 @@ public:
         delete [] Int_rec;
         return res;
     }
+    // little endian floats, bottom row first, nothing clamped
+    int savePFM(const char* filename) {
+        FILE *f = fopen(filename, "wb");
+        if (f == nullptr)
+            return 0;
+        fprintf(f, "PF\n%d %d\n-1.0\n", width, height);
+        for (int i = 0; i < width * height; i++) {
+            float c[3] = {float(rec[i].x), float(rec[i].y), float(rec[i].z)};
+            fwrite(c, sizeof(float), 3, f);
+        }
+        fclose(f);
+        return 1;
+    }
     void SaveImage(const char * filename) {
         int len = strlen(filename);
         if(strcmp(".bmp", filename+len-4)==0){
             saveBMP(filename);
+        }else if(strcmp(".pfm", filename+len-4)==0){
+            savePFM(filename);
         }else if(strcmp(".png", filename+len-4)==0){
             savePNG(filename);
         }else{
@@ -0,0 +1,356 @@
+#ifndef __INTEGRATOR_H__
+#define __INTEGRATOR_H__
+
+#include "utils.hpp"
+#include "ray.hpp"
+#include "shape.hpp"
+#include "material.hpp"
+#include "sampler.hpp"
+#include "lights.hpp"
+#include "constant_medium.hpp"
+#include <cassert>
+#include <cstdio>
+
+const int MAX_BOUNCES = 10;
+
+// Per-bounce path statistics. Each thread fills its own copy, they are
+// merged with add() when the render is done.
+struct PathStats
+{
+    long long paths = 0;
+    long long hits[MAX_BOUNCES] = {};  // paths that hit a surface at bounce i
+    long long escaped = 0;             // left the scene, got the background
+    long long absorbed = 0;            // the material did not scatter
+    long long roulette = 0;            // killed by Russian roulette
+    long long truncated = 0;           // reached MAX_BOUNCES
+    long long shadow_rays = 0;
+
+    void add(const PathStats &s)
+    {
+        paths += s.paths;
+        for (int i = 0; i < MAX_BOUNCES; ++i)
+            hits[i] += s.hits[i];
+        escaped += s.escaped;
+        absorbed += s.absorbed;
+        roulette += s.roulette;
+        truncated += s.truncated;
+        shadow_rays += s.shadow_rays;
+    }
+
+    // rays traced: one per bounce, plus the shadow rays
+    long long rays() const
+    {
+        long long n = escaped + shadow_rays;
+        for (int i = 0; i < MAX_BOUNCES; ++i)
+            n += hits[i];
+        return n;
+    }
+
+    void print(FILE *f) const
+    {
+        long long rays = this->rays() - shadow_rays;
+        fprintf(f, "[Path] %lld paths, %.2f rays per path: %.1f%% escaped, %.1f%% absorbed, "
+                "%.1f%% roulette, %.1f%% truncated\n", paths, double(rays) / paths,
+                100.0 * escaped / paths, 100.0 * absorbed / paths,
+                100.0 * roulette / paths, 100.0 * truncated / paths);
+        fprintf(f, "[Path] hits per bounce:");
+        for (int i = 0; i < MAX_BOUNCES && hits[i]; ++i)
+            fprintf(f, " %.3f", double(hits[i]) / paths);
+        fprintf(f, "\n");
+        if (shadow_rays)
+            fprintf(f, "[Path] %.2f shadow rays per path\n", double(shadow_rays) / paths);
+    }
+};
+
+// power heuristic for combining two sampling strategies
+inline double mis_weight(double pdf, double other_pdf)
+{
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// State of a path between bounces, so the bounces of many paths can be
+// interleaved (see wavefront.hpp).
+struct PathState
+{
+    Ray ray;
+    Vec3 color, throughput = Vec3(1, 1, 1);
+    int bounce = 0;
+    // the previous bounce sampled lights too: its point, the normal the
+    // lights were picked with and the pdf of the direction it scattered to
+    bool sampled_lights = false;
+    Vec3 last_p, last_n;
+    double last_pdf = 0;
+    bool specular = false;  // the last scatter took a delta direction
+};
+
+// What the camera ray of a path sees, the guide of the denoiser: surface
+// color, normal and distance of the first hit that does not scatter into
+// a delta direction, so mirrors and glass show what they reflect. Rays
+// that escape see the background color, with no normal and zero depth.
+// The material and object ids are those of the first hit, 0 for none.
+struct Features
+{
+    Vec3 albedo, normal;
+    double depth = 0;
+    int material_id = 0, object_id = 0;
+};
+
+// Light sample of a bounce, waiting for its visibility test: `color` is
+// added to the path, weighted by how much of it gets through along `ray`
+// before `dist` (see visibility).
+struct ShadowRay
+{
+    Ray ray;
+    double dist;
+    Vec3 color;
+};
+
+// Unidirectional path tracer. The path is followed in a loop that carries
+// its throughput forward and adds emitted light as it is found, instead of
+// recursing once per bounce and multiplying on the way back up.
+//
+// With a light list, every hit on a material with a pdf also samples a
+// point on a light and casts a shadow ray to it (next event estimation).
+// Light reached both ways is weighted by multiple importance sampling.
+class PathTracer
+{
+public:
+    PathTracer(Object *scene_, const Vec3 &bg, const LightList *lights_ = nullptr,
+               const std::vector<const Medium *> *media_ = nullptr)
+        : scene(scene_), background(bg), lights(lights_ && !lights_->empty() ? lights_ : nullptr),
+          media(media_) {}
+
+    // also fills `features` of the first hit when given
+    Vec3 radiance(Ray r, Sampler &sampler, PathStats &stats, Features *features = nullptr) const
+    {
+        PathState path;
+        path.ray = r;
+        Hit hit;
+        bool found = extend(path, sampler, hit);
+        return radiance(path, found, hit, sampler, stats, features);
+    }
+
+    // Follows a path whose first hit is already known, e.g. from
+    // extend_packet; the sampler must be where that extend left it.
+    Vec3 radiance(PathState &path, bool found, Hit hit, Sampler &sampler, PathStats &stats,
+                  Features *features = nullptr) const
+    {
+        bool find_features = features != nullptr;
+        ++stats.paths;
+        for (;;)
+        {
+            if (find_features)
+                record_features(path, found, hit, *features);
+            ShadowRay shadow;
+            bool shadowed = false;
+            bool alive = shade(path, found, hit, sampler, stats, shadow, shadowed);
+            find_features = find_features && path.specular;
+            double v = shadowed ? visibility(shadow) : 0;
+            if (v > 0)
+                path.color += shadow.color * v;
+            if (!alive)
+                return path.color;
+            hit = Hit();
+            found = extend(path, sampler, hit);
+        }
+    }
+
+    // The stages of a bounce, for integrators that schedule them
+    // themselves. The sampler must be positioned on the path's sample.
+
+    // finds the closest hit of the path's ray
+    bool extend(const PathState &path, Sampler &sampler, Hit &hit) const
+    {
+        sampler.set_dimension(SAMPLER_CAMERA_DIMS + path.bounce * SAMPLER_BOUNCE_DIMS);
+        return scene->closest_hit(path.ray, 0.001, MAX_double, hit);
+    }
+
+    // extend for the camera rays of new paths, traced as one packet; every
+    // ray carries the sampler of its own path
+    void extend_packet(RayPacket &packet) const
+    {
+        for (int i = 0; i < packet.n; ++i)
+            packet.rays[i].sampler->set_dimension(SAMPLER_CAMERA_DIMS);
+        packet.t_min = 0.001;
+        packet.prepare();
+        scene->closest_hit_packet(packet);
+    }
+
+    // features of the path's hit, before it is shaded
+    void record_features(const PathState &path, bool found, const Hit &hit, Features &f) const
+    {
+        if (path.bounce == 0)
+        {
+            f.material_id = found && hit.material != nullptr ? hit.material->id : 0;
+            f.object_id = found ? hit.obj->id : 0;
+        }
+        if (!found)
+        {
+            f.albedo = path.throughput.mult(background).clip();
+            f.normal = Vec3();
+            f.depth = 0;
+            return;
+        }
+        Vec3 color = hit.material != nullptr ? hit.material->base_color(hit) : Vec3(1, 1, 1);
+        f.albedo = path.throughput.mult(color).clip();
+        f.normal = hit.norm;
+        f.depth = hit.t;
+    }
+
+    // Quick look at the first hits only: the albedo lit from the camera,
+    // emitters at their own color. Fills `features` like radiance.
+    Vec3 preview(Ray r, Sampler &sampler, PathStats &stats, Features *features = nullptr) const
+    {
+        PathState path;
+        path.ray = r;
+        Hit hit;
+        bool found = extend(path, sampler, hit);
+        return preview(path, found, hit, stats, features);
+    }
+    Vec3 preview(const PathState &path, bool found, const Hit &hit, PathStats &stats,
+                 Features *features = nullptr) const
+    {
+        Features f;
+        record_features(path, found, hit, f);
+        if (features != nullptr)
+            *features = f;
+        ++stats.paths;
+        if (!found)
+        {
+            ++stats.escaped;
+            return background;
+        }
+        ++stats.hits[0];
+        if (hit.material != nullptr && hit.material->emits())
+            return hit.material->illuminate(hit.u, hit.v, hit.p);
+        return f.albedo * (0.2 + 0.8 * fabs(hit.norm.dot(path.ray.d)));
+    }
+
+    // Adds the light found at the hit, samples a light into `shadow`
+    // (setting `shadowed`) and scatters. Returns whether the path goes on.
+    bool shade(PathState &path, bool found, const Hit &hit, Sampler &sampler, PathStats &stats,
+               ShadowRay &shadow, bool &shadowed) const
+    {
+        shadowed = false;
+        if (!found)
+        {
+            ++stats.escaped;
+            path.color += path.throughput.mult(background);
+            return false;
+        }
+        ++stats.hits[path.bounce];
+        const Ray &r = path.ray;
+        if (hit.material->emits())
+        {
+            Vec3 emitted = hit.material->illuminate(hit.u, hit.v, hit.p);
+            if (path.sampled_lights)
+            {
+                double light_pdf = lights->pmf(path.last_p, path.last_n, hit.obj) * hit.obj->pdf_direction(path.last_p, hit);
+                emitted = emitted * mis_weight(path.last_pdf, light_pdf);
+            }
+            path.color += path.throughput.mult(emitted);
+        }
+        Vec3 attenuation;
+        Ray scattered;
+        double pdf;
+        path.specular = false;
+        if (!hit.material->scatter(r, hit, attenuation, scattered, pdf))
+        {
+            ++stats.absorbed;
+            return false;
+        }
+        path.specular = pdf == 0;
+        path.sampled_lights = lights && hit.material->has_pdf();
+        if (path.sampled_lights)
+        {
+            // lights below a one-sided surface cannot contribute
+            Vec3 n = hit.material->one_sided() ? hit.norm : Vec3();
+            shadowed = sample_light(r, hit, n, sampler, stats, shadow);
+            if (shadowed)
+                shadow.color = path.throughput.mult(shadow.color);
+            path.last_p = hit.p;
+            path.last_n = n;
+            path.last_pdf = pdf;
+        }
+        path.throughput = path.throughput.mult(attenuation);
+        if (path.bounce >= RR_START_BOUNCE)
+        {
+            // survive with the probability of the largest throughput
+            // channel, and divide by it to stay unbiased
+            double p = fmin(1.0, fmax(path.throughput.x, fmax(path.throughput.y, path.throughput.z)));
+            if (sampler.next() >= p)
+            {
+                ++stats.roulette;
+                return false;
+            }
+            path.throughput = path.throughput / p;
+        }
+        // the draws of the bounce stay in its block, media hash their own
+        assert(sampler.dimension() <= SAMPLER_CAMERA_DIMS + (path.bounce + 1) * SAMPLER_BOUNCE_DIMS);
+        path.ray = scattered;
+        if (++path.bounce == MAX_BOUNCES)
+        {
+            ++stats.truncated;
+            return false;
+        }
+        return true;
+    }
+
+    // Fraction of a light sample that reaches the path: 0 when a surface
+    // in front of the sampled point blocks it, else the transmittance of
+    // the media on the way. Stops a little short so the light itself does
+    // not count.
+    double visibility(const ShadowRay &shadow) const
+    {
+        double t_max = shadow.dist * (1 - 1e-4);
+        if (scene->occluded(shadow.ray, 0.001, t_max))
+            return 0;
+        double tr = 1;
+        if (media != nullptr)
+            for (const Medium *medium : *media)
+            {
+                tr *= medium->transmittance(shadow.ray, 0.001, t_max);
+                if (tr == 0)
+                    break;
+            }
+        return tr;
+    }
+
+private:
+    static const int RR_START_BOUNCE = 3;
+    Object *scene;
+    Vec3 background;
+    const LightList *lights;  // nullptr without next event estimation
+    const std::vector<const Medium *> *media;
+
+    // light sampling half of the estimate at a hit on a material with a
+    // pdf, picking the light with the normal n (see LightList::pick)
+    bool sample_light(const Ray &r, const Hit &hit, const Vec3 &n, Sampler &sampler, PathStats &stats,
+                      ShadowRay &shadow) const
+    {
+        double pmf, dist;
+        Vec3 wi;
+        const Object *light = lights->pick(hit.p, n, sampler, pmf);
+        if (light == nullptr)
+            return false;
+        double pdf = light->sample_direction(hit.p, sampler, wi, dist);
+        if (pdf <= 0)
+            return false;
+        Vec3 f = hit.material->eval(r, hit, wi);
+        if (f.x <= 0 && f.y <= 0 && f.z <= 0)
+            return false;
+        ++stats.shadow_rays;
+        shadow.ray = Ray(hit.p, wi, r.time, r.sampler);
+        shadow.dist = dist;
+        Hit light_hit;
+        light_hit.t = dist;
+        light_hit.obj = light;
+        light->get_surface(shadow.ray, light_hit);
+        double light_pdf = pmf * pdf;
+        Vec3 emitted = light_hit.material->illuminate(light_hit.u, light_hit.v, light_hit.p);
+        shadow.color = f.mult(emitted) * (mis_weight(light_pdf, hit.material->pdf(r, hit, wi)) / light_pdf);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef __LIGHTS_H__
+#define __LIGHTS_H__
+
+#include "shape.hpp"
+#include "sampler.hpp"
+#include "bbox.hpp"
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+enum LightSampling { LIGHTS_UNIFORM, LIGHTS_BVH };
+
+inline bool parse_light_sampling(const char *name, LightSampling &mode)
+{
+    if (!strcmp(name, "uniform"))
+        mode = LIGHTS_UNIFORM;
+    else if (!strcmp(name, "bvh"))
+        mode = LIGHTS_BVH;
+    else
+        return false;
+    return true;
+}
+
+// Emitters of the scene that next event estimation samples, gathered by
+// the scene parser. A light is picked uniformly, or from a hierarchy over
+// the lights in proportion to an estimate of what each contributes at the
+// shading point (Conty Estevez and Kulla, "Importance Sampling of Many
+// Lights with Adaptive Tree Splitting"): descending the tree, a child is
+// chosen by its total power over its squared distance, times a bound of
+// the cosine at the shading point. All emitters here light both sides of
+// their surface, or are spheres, so the emitters' orientation cones of
+// that paper would span every direction and are left out.
+class LightList
+{
+public:
+    void add(const Object *light)
+    {
+        index[light] = int(lights.size());
+        lights.push_back(light);
+    }
+    bool empty() const { return lights.empty(); }
+    int size() const { return int(lights.size()); }
+
+    void set_sampling(LightSampling mode_) { mode = mode_; }
+
+    // call once all lights are added
+    void build()
+    {
+        nodes.clear();
+        leaf.assign(lights.size(), -1);
+        if (lights.empty())
+            return;
+        std::vector<Node> prims(lights.size());
+        std::vector<int> order(lights.size());
+        for (int i = 0; i < size(); ++i)
+        {
+            const Object *light = lights[i];
+            AABB box;
+            light->bounding_box(0, 1, box);
+            Vec3 c = box.centroid();
+            Vec3 emitted = light->material->illuminate(0.5, 0.5, c);
+            prims[i].lo = box.min();
+            prims[i].hi = box.max();
+            prims[i].power = (0.2126 * emitted.x + 0.7152 * emitted.y + 0.0722 * emitted.z) * light->area();
+            prims[i].light = i;
+            order[i] = i;
+        }
+        build(prims, order, 0, size(), -1);
+    }
+
+    // A light for the point p, with the probability of picking it. n is
+    // the normal at p when only lights above it can contribute, or zero,
+    // e.g. in a medium. Draws one dimension; returns nullptr when no light
+    // can reach p.
+    const Object *pick(const Vec3 &p, const Vec3 &n, Sampler &sampler, double &pmf) const
+    {
+        double u = sampler.next();
+        if (mode == LIGHTS_UNIFORM || nodes.empty())
+        {
+            int i = std::min(int(u * lights.size()), int(lights.size()) - 1);
+            pmf = 1.0 / lights.size();
+            return lights[i];
+        }
+        pmf = 1;
+        int cur = 0;
+        while (nodes[cur].light < 0)
+        {
+            int a = cur + 1, b = nodes[cur].second;
+            double ia = importance(nodes[a], p, n), ib = importance(nodes[b], p, n);
+            if (ia + ib <= 0)
+                return nullptr;
+            // reuse u for the choices further down
+            double pa = ia / (ia + ib);
+            if (u < pa)
+            {
+                u = std::min(u / pa, 1.0 - 1e-16);
+                pmf *= pa;
+                cur = a;
+            }
+            else
+            {
+                u = std::min((u - pa) / (1 - pa), 1.0 - 1e-16);
+                pmf *= 1 - pa;
+                cur = b;
+            }
+        }
+        return lights[nodes[cur].light];
+    }
+
+    // probability of pick choosing `light` at p and n, 0 if it is not in
+    // the list
+    double pmf(const Vec3 &p, const Vec3 &n, const Object *light) const
+    {
+        auto it = index.find(light);
+        if (it == index.end())
+            return 0;
+        if (mode == LIGHTS_UNIFORM || nodes.empty())
+            return 1.0 / lights.size();
+        double pmf = 1;
+        for (int cur = leaf[it->second]; nodes[cur].parent >= 0; cur = nodes[cur].parent)
+        {
+            int parent = nodes[cur].parent;
+            int sibling = cur == parent + 1 ? nodes[parent].second : parent + 1;
+            double ic = importance(nodes[cur], p, n), is = importance(nodes[sibling], p, n);
+            if (ic <= 0)
+                return 0;
+            pmf *= ic / (ic + is);
+        }
+        return pmf;
+    }
+
+private:
+    // Depth-first: the first child of an interior node follows it, the
+    // second is at `second`. Leaves hold one light.
+    struct Node
+    {
+        Vec3 lo, hi;
+        double power;
+        int light = -1;   // index of the light of a leaf, -1 inside
+        int second = -1;
+        int parent = -1;
+    };
+
+    std::vector<const Object *> lights;
+    std::unordered_map<const Object *, int> index;
+    LightSampling mode = LIGHTS_BVH;
+    std::vector<Node> nodes;
+    std::vector<int> leaf;  // node of each light
+
+    // Lights [begin, end) of `order`, split at the median of their
+    // centers along the widest axis.
+    int build(const std::vector<Node> &prims, std::vector<int> &order, int begin, int end, int parent)
+    {
+        int id = int(nodes.size());
+        nodes.push_back(Node());
+        if (end - begin == 1)
+        {
+            Node n = prims[order[begin]];
+            n.parent = parent;
+            nodes[id] = n;
+            leaf[n.light] = id;
+            return id;
+        }
+        Vec3 lo = prims[order[begin]].lo, hi = prims[order[begin]].hi, c_lo = (lo + hi) * 0.5, c_hi = c_lo;
+        double power = 0;
+        for (int i = begin; i < end; ++i)
+        {
+            const Node &n = prims[order[i]];
+            Vec3 c = (n.lo + n.hi) * 0.5;
+            for (int a = 0; a < 3; ++a)
+            {
+                lo[a] = fmin(lo[a], n.lo[a]);
+                hi[a] = fmax(hi[a], n.hi[a]);
+                c_lo[a] = fmin(c_lo[a], c[a]);
+                c_hi[a] = fmax(c_hi[a], c[a]);
+            }
+            power += n.power;
+        }
+        Vec3 extent = c_hi - c_lo;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        int mid = (begin + end) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+            return prims[a].lo[axis] + prims[a].hi[axis] < prims[b].lo[axis] + prims[b].hi[axis];
+        });
+        build(prims, order, begin, mid, id);
+        int second = build(prims, order, mid, end, id);
+        Node &n = nodes[id];
+        n.lo = lo;
+        n.hi = hi;
+        n.power = power;
+        n.second = second;
+        n.parent = parent;
+        return id;
+    }
+
+    // Power over the squared distance to the node's box, which no light
+    // inside is closer than. The distance is kept from dropping below a
+    // quarter of the box's half diagonal, so points inside or close to a
+    // cluster do not favour it without bound. With a normal, a box wholly
+    // below the tangent plane at p gets 0, and the others are weighted by
+    // the cosine of the smallest angle between n and the box's bounding
+    // sphere.
+    static double importance(const Node &node, const Vec3 &p, const Vec3 &n)
+    {
+        double d2 = 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            double d = fmax(fmax(node.lo[a] - p[a], p[a] - node.hi[a]), 0.0);
+            d2 += d * d;
+        }
+        double r2 = (node.hi - node.lo).len2() / 4;
+        double cosine = 1;
+        if (n.len2() > 0)
+        {
+            // the corner farthest along n
+            Vec3 top(n.x > 0 ? node.hi.x : node.lo.x, n.y > 0 ? node.hi.y : node.lo.y,
+                     n.z > 0 ? node.hi.z : node.lo.z);
+            if (n.dot(top - p) <= 0)
+                return 0;
+            Vec3 w = (node.lo + node.hi) * 0.5 - p;
+            double l2 = w.len2();
+            if (l2 > r2)
+            {
+                double cos_w = n.dot(w) / sqrt(l2 * n.len2());
+                double cos_b = sqrt(1 - r2 / l2);
+                if (cos_w < cos_b)
+                    cosine = fmax(cos_w * cos_b + sqrt(fmax(1 - cos_w * cos_w, 0.0) * (r2 / l2)), 0.0);
+            }
+        }
+        return node.power * cosine / fmax(fmax(d2, r2 / 16), 1e-12);
+    }
+};
+
+#endif
@@ -7,102 +7,365 @@
 #include <cstring>
 #include <cmath>
 #include "scene_parser.hpp"
+#include "integrator.hpp"
+#include "film.hpp"
+#include "tiles.hpp"
+#include "wavefront.hpp"
+#include "denoise.hpp"
+#include <omp.h>
+#include <algorithm>
 
 
-const int max_depth = 20;
-
-Vec3 get_color(const Ray &r, Object *objs, const Vec3 &bg, int depth, unsigned short* Xi)
+int main(int argc, char **argv)
 {
-    Hit hit;
-    if (depth >= max_depth) return Vec3();
-    if (objs->intersect(r, 0.001, MAX_double, hit))
-    {
-        Ray s_ray;
-        Vec3 dir = r.direction();
-        // fprintf(stderr ,"%f %f %F\n", dir.x, dir.y, dir.z);
-        Vec3 attenuation;
-        Vec3 illuminated = hit.material->illuminate(hit.u, hit.v, hit.p);
-        if  (hit.material->scatter(r, hit, attenuation, s_ray))
-        {
-            Vec3 f = attenuation;
-            double p = f.x > f.y && f.x > f.z ? f.x : f.y > f.z ? f.y: f.z;
-            if (++depth > 5)
-                if (erand48(Xi) < p)
-                    f = f * (1 / p);
-                else return illuminated;
-            Vec3 new_color = get_color(s_ray, objs, bg, depth + 1, Xi).mult(f);
-            return new_color + illuminated;
+    uint64_t seed = 0;
+    bool nee = true;
+    LightSampling light_sampling = LIGHTS_BVH;
+    SamplerType sampler_type = SAMPLER_SOBOL;
+    double adaptive = 0;    // target relative error, 0 samples every pixel fully
+    int min_spp = 64;
+    const char *spp_file = nullptr;
+    int tile_size = 16;
+    TileOrder tile_order = TILES_MORTON;
+    bool wavefront = false;
+    bool packets = false;
+    int pass_spp = 0;          // 0 renders everything in one pass
+    const char *checkpoint_file = nullptr, *resume_file = nullptr;
+    double time_limit = 0;     // seconds, 0 for none
+    bool denoise = false;
+    bool preview = false;
+    std::vector<std::pair<AOV, const char*>> aovs;
+    AOV aov;
+    for (int i = 4; i < argc; ++i) {
+        if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            seed = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--no-nee"))
+            nee = false;
+        else if (!strcmp(argv[i], "--sampler") && i + 1 < argc && parse_sampler_type(argv[i + 1], sampler_type))
+            ++i;
+        else if (!strcmp(argv[i], "--light-sampling") && i + 1 < argc
+                 && parse_light_sampling(argv[i + 1], light_sampling))
+            ++i;
+        else if (!strcmp(argv[i], "--adaptive") && i + 1 < argc)
+            adaptive = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--min-spp") && i + 1 < argc)
+            min_spp = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--spp-image") && i + 1 < argc)
+            spp_file = argv[++i];
+        else if (!strcmp(argv[i], "--tile-size") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            tile_size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--tile-order") && i + 1 < argc && parse_tile_order(argv[i + 1], tile_order))
+            ++i;
+        else if (!strcmp(argv[i], "--wavefront"))
+            wavefront = true;
+        else if (!strcmp(argv[i], "--packets"))
+            packets = true;
+        else if (!strcmp(argv[i], "--pass-spp") && i + 1 < argc)
+            pass_spp = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc)
+            checkpoint_file = argv[++i];
+        else if (!strcmp(argv[i], "--resume") && i + 1 < argc)
+            resume_file = argv[++i];
+        else if (!strcmp(argv[i], "--time-limit") && i + 1 < argc)
+            time_limit = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--denoise"))
+            denoise = true;
+        else if (!strcmp(argv[i], "--preview"))
+            preview = true;
+        else if (!strcmp(argv[i], "--aov") && i + 2 < argc && parse_aov(argv[i + 1], aov)) {
+            aovs.push_back(std::make_pair(aov, argv[i + 2]));
+            i += 2;
         }
         else
-            return illuminated;
+            argc = 0;
     }
-
-    else return bg;
-
-    //background color
-    // {
-    //     // fprintf(stderr, "%d ", depth);
-    //     Vec3 dir = r.direction();
-    //     double t = 0.5 * (dir.y + 1.0);
-
-    //     return Vec3(1, 1, 1) * (1 - t) + Vec3(0.5, 0.7, 1.0) * t;
-    // }
-}
-
-int main(int argc, char **argv)
-{
-    if (argc != 4) {
-        fprintf(stderr, "Usage: ./main <input scene file> <output bmp file> <samp:int>\n");
+    if (preview)
+        wavefront = false;  // the wavefront stages are those of full paths
+    if (argc < 4) {
+        fprintf(stderr, "Usage: ./main <input scene file> <output bmp file> <samp:int> [--seed <n>] [--no-nee]\n"
+                        "              [--sampler independent|stratified|sobol] [--light-sampling uniform|bvh]\n"
+                        "              [--adaptive <relative error> [--min-spp <n>] [--spp-image <file>]]\n"
+                        "              [--tile-size <pixels>] [--tile-order morton|center|rows]\n"
+                        "              [--wavefront | --packets]\n"
+                        "              [--pass-spp <n>] [--checkpoint <file>] [--resume <file>] [--time-limit <s>]\n"
+                        "              [--denoise] [--preview]\n"
+                        "              [--aov depth|normal|albedo|material|object|spp <file>]...\n");
         return 1;
     }
     SceneParser parser = SceneParser(argv[1]);
     
     Camera* camera = parser.getCamera();
-    int w = camera->width, h =camera->height, samps = atoi(argv[3]) / 4; // # samples
-    Image image(w, h);
-    image.setAllPixel(Vec3());
+    int w = camera->width, h =camera->height, samps = atoi(argv[3]) / 4; // # samples per subpixel
+    // With --adaptive, samps is the budget: every pixel takes min_rounds
+    // rounds of one sample per subpixel, and then more until its relative
+    // error is below the target.
+    int min_rounds = adaptive > 0 ? std::max(1, std::min(samps, min_spp / 4)) : samps;
+    Film film(w, h);
+    // --resume takes the film, the sampler and the finished rounds from a
+    // checkpoint and renders on up to samps; the checkpoint is updated in
+    // place unless --checkpoint names another file. Stratified samples are
+    // laid out for the count they were started with, so such a render can
+    // only be resumed to that count, and every render only with the
+    // options and scene it was started with.
+    uint64_t scene_hash = hash_bytes(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    hash_file(argv[1], scene_hash);
+    int start_round = 0;
+    if (resume_file != nullptr) {
+        Checkpoint c;
+        if (!load_checkpoint(resume_file, c, film)) {
+            fprintf(stderr, "Cannot resume from %s: not a checkpoint of a %dx%d image\n", resume_file, w, h);
+            return 1;
+        }
+        if (c.sampler_type == SAMPLER_STRATIFIED && c.sampler_spp != samps) {
+            fprintf(stderr, "Cannot resume from %s: its stratified samples are laid out for %d spp, not %d\n",
+                    resume_file, c.sampler_spp * Film::SUBPIXELS, samps * Film::SUBPIXELS);
+            return 1;
+        }
+        const char *changed = c.nee != int32_t(nee) ? "--no-nee"
+                              : c.light_sampling != int32_t(light_sampling) ? "--light-sampling"
+                              : c.adaptive != adaptive || (adaptive > 0 && c.min_spp != min_spp) ? "--adaptive or --min-spp"
+                              : c.scene_hash != scene_hash ? "the scene file"
+                              : nullptr;
+        if (changed != nullptr) {
+            fprintf(stderr, "Cannot resume from %s: %s differs from the render it was started with\n",
+                    resume_file, changed);
+            return 1;
+        }
+        start_round = c.rounds_done;
+        sampler_type = SamplerType(c.sampler_type);
+        seed = c.seed;
+        if (checkpoint_file == nullptr)
+            checkpoint_file = resume_file;
+        fprintf(stderr, "[Resume] %d spp from %s\n", start_round * Film::SUBPIXELS, resume_file);
+    }
+    // Progressive passes of pass_rounds rounds each; after every pass the
+    // image and the checkpoint are written.
+    int pass_rounds = pass_spp > 0 ? std::max(1, pass_spp / 4) : std::max(1, samps - start_round);
+    int n_passes = std::max(0, (samps - start_round + pass_rounds - 1) / pass_rounds);
     // ObjectList world = moving_scene();
     // ObjectList world = random_scene();
     // ObjectList world = perlin_scene();
-    ObjectList* world = parser.getGroup();
+    Object* world = parser.getScene();
     // Camera* camera = getCam(w, h);
 
-    Vec3 color;
-#pragma omp parallel for schedule(dynamic, 1) private(color) // OpenMP
-
-    for (int y = 0; y < h; y++)
-    { // Loop over image rows
-        fprintf(stderr, "\rRendering (%d spp) %5.2f%%", samps, 100. * y / (h - 1));
-        for (unsigned short x = 0, Xi[3] = {0, 0, (unsigned short)(y * y * y)}; x < w; x++){
-            color = Vec3();
-            // int count = 0;
-            for (int sy = 0, i = (h - y - 1) * w + x; sy < 2; sy++)       // 2x2 subpixel rows
-                for (int sx = 0; sx < 2; sx++){
-                    // fprintf(stderr, "start looping x%d y%d\n", x, y);
-                    Vec3 samp_color;
-                    for (int s = 0; s < samps; s++)
+    LightList lights = parser.getLights();
+    lights.set_sampling(light_sampling);
+    PathTracer tracer(world, parser.getBackgroundColor(), nee ? &lights : nullptr, &parser.getMedia());
+    PathStats stats;
+    std::vector<Tile> tiles = make_tiles(w, h, tile_size, tile_order);
+    std::vector<double> tile_ms(tiles.size());
+    long long steals = 0;
+    char label[64];
+    snprintf(label, sizeof(label), "Rendering (%d spp)", samps);
+    Progress progress(label, (long long) w * h * n_passes);
+    // camera ray of sample s of subpixel (sx, sy) of pixel (x, y); each
+    // subpixel is a pixel of the sampler, with its own sample set
+    auto camera_ray = [&](int x, int y, int sx, int sy, int s, Sampler &sampler) {
+        sampler.start_pixel((uint64_t(y) * w + x) * 4 + sy * 2 + sx);
+        sampler.start_sample(s);
+        double r1, r2;
+        sampler.next_2d(r1, r2);
+        r1 *= 2;
+        r2 *= 2;
+        double dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
+        double dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
+        double u = double(x + (sx + 0.5 + dx)/2) / double(w);
+        double v = double(y + (sy + 0.5 + dy)/2) / double(h);
+        return camera->generate_ray(u, v, sampler);
+    };
+    // a round of pixel (x, y) with the features of its first hits
+    auto add_round = [&](int x, int y, const Vec3 *colors, const Features *features) {
+        film.add_round(x, y, colors);
+        Vec3 albedo, normal;
+        double depth = 0;
+        for (int j = 0; j < Film::SUBPIXELS; ++j) {
+            albedo += features[j].albedo / Film::SUBPIXELS;
+            normal += features[j].normal / Film::SUBPIXELS;
+            depth += features[j].depth / Film::SUBPIXELS;
+        }
+        film.add_features(x, y, albedo, normal, depth, features[0].material_id, features[0].object_id);
+    };
+    auto save_images = [&]() {
+        Image image(w, h);
+        if (denoise) {
+            double start_ms = progress.elapsed_ms();
+            develop_denoised(film, image);
+            fprintf(stderr, "\n[Denoise] %.2f s\n", (progress.elapsed_ms() - start_ms) / 1000);
+        } else {
+            film.develop(image);
+        }
+        image.SaveImage(argv[2]);
+        if (spp_file != nullptr) {
+            Image spp(w, h);
+            film.develop_spp(spp, samps * Film::SUBPIXELS);
+            spp.SaveImage(spp_file);
+        }
+        // .pfm files get the values themselves, other formats a view
+        for (const auto &a : aovs) {
+            int len = strlen(a.second);
+            Image aov_image(w, h);
+            film.develop_aov(aov_image, a.first, len >= 4 && !strcmp(a.second + len - 4, ".pfm"));
+            aov_image.SaveImage(a.second);
+        }
+    };
+    int rounds_done = start_round;
+    while (rounds_done < samps) {
+        int pass_begin = rounds_done, pass_end = std::min(samps, rounds_done + pass_rounds);
+        TileQueue queue(int(tiles.size()), omp_get_max_threads());
+#pragma omp parallel // OpenMP
+        {
+            PathStats thread_stats;
+            Sampler *sampler = make_sampler(sampler_type, seed, samps);
+            WavefrontTracer wavefront_tracer(tracer);
+            std::vector<WavefrontPath> batch;
+            std::vector<int> batch_pixels;
+            RayPacket *packet = new RayPacket;
+            // every path of a packet needs a sampler of its own
+            std::vector<Sampler*> packet_samplers;
+            if (packets)
+                for (int i = 0; i < PACKET_SIZE; ++i)
+                    packet_samplers.push_back(make_sampler(sampler_type, seed, samps));
+            int t;
+            while (queue.next(omp_get_thread_num(), t))
+            {
+                const Tile &tile = tiles[t];
+                double start_ms = progress.elapsed_ms();
+                if (packets && !wavefront) {
+                    // Camera rays of 4x4 pixels, 2x2 subpixels each, are traced
+                    // as one packet; the paths then go on one at a time.
+                    for (int s = pass_begin; s < pass_end; s++)
+                    {
+                        bool any = false;
+                        for (int by = tile.y0; by < tile.y1; by += 4)
+                            for (int bx = tile.x0; bx < tile.x1; bx += 4){
+                                packet->clear();
+                                batch_pixels.clear();
+                                for (int y = by; y < std::min(by + 4, tile.y1); y++)
+                                    for (int x = bx; x < std::min(bx + 4, tile.x1); x++){
+                                        if (s >= min_rounds && film.relative_error(x, y) < adaptive)
+                                            continue;
+                                        batch_pixels.push_back(y * w + x);
+                                        for (int sy = 0; sy < 2; sy++)
+                                            for (int sx = 0; sx < 2; sx++)
+                                                packet->add(camera_ray(x, y, sx, sy, s, *packet_samplers[packet->n]), MAX_double);
+                                    }
+                                if (packet->n == 0)
+                                    continue;
+                                any = true;
+                                tracer.extend_packet(*packet);
+                                for (int k = 0; k < (int) batch_pixels.size(); ++k){
+                                    Vec3 colors[Film::SUBPIXELS];
+                                    Features features[Film::SUBPIXELS];
+                                    for (int j = 0; j < Film::SUBPIXELS; ++j){
+                                        int i = k * Film::SUBPIXELS + j;
+                                        PathState path;
+                                        path.ray = packet->rays[i];
+                                        if (preview)
+                                            colors[j] = tracer.preview(path, packet->found[i], packet->hits[i],
+                                                                       thread_stats, &features[j]);
+                                        else
+                                            colors[j] = tracer.radiance(path, packet->found[i], packet->hits[i],
+                                                                        *packet->rays[i].sampler, thread_stats, &features[j]);
+                                    }
+                                    add_round(batch_pixels[k] % w, batch_pixels[k] / w, colors, features);
+                                }
+                            }
+                        if (!any)
+                            break;
+                    }
+                } else if (!wavefront) {
+                    for (int y = tile.y0; y < tile.y1; y++)
+                        for (int x = tile.x0; x < tile.x1; x++){
+                            for (int s = pass_begin; s < pass_end; s++)
+                            {
+                                if (s >= min_rounds && film.relative_error(x, y) < adaptive)
+                                    break;
+                                Vec3 colors[Film::SUBPIXELS];
+                                Features features[Film::SUBPIXELS];
+                                for (int sy = 0; sy < 2; sy++)       // 2x2 subpixel rows
+                                    for (int sx = 0; sx < 2; sx++){
+                                        Ray ray = camera_ray(x, y, sx, sy, s, *sampler);
+                                        Features *f = &features[sy * 2 + sx];
+                                        colors[sy * 2 + sx] = preview ? tracer.preview(ray, *sampler, thread_stats, f)
+                                                                      : tracer.radiance(ray, *sampler, thread_stats, f);
+                                    }
+                                add_round(x, y, colors, features);
+                            }
+                        }
+                } else {
+                    // one round of the pixels of the tile that are not done yet
+                    // is a batch
+                    for (int s = pass_begin; s < pass_end; s++)
                     {
-                        // ++count;
-                        
-                        double r1 = 2 * erand48(Xi), dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
-                        double r2 = 2 * erand48(Xi), dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
-                        double u = double(x + (sx + 0.5 + dx)/2) / double(w);
-                        double v = double(y + (sy + 0.5 + dy)/2) / double(h);
-                        // fprintf(stderr, "\nstart_ray");
-                        Ray ray = camera->generate_ray(u, v);
-                        // fprintf(stderr, "origin %f %f %f, dir %f %f %f\n", ray.o.x, ray.o.y, ray.o.z, ray.d.x, ray.d.y, ray.d.z);
-                        // fprintf(stderr, "\nfinish_ray");
-                        
-                        samp_color += get_color(ray, world, parser.getBackgroundColor(), 0, Xi) * 1.0/ samps;
-                        // count++;
+                        batch.clear();
+                        batch_pixels.clear();
+                        for (int y = tile.y0; y < tile.y1; y++)
+                            for (int x = tile.x0; x < tile.x1; x++){
+                                if (s >= min_rounds && film.relative_error(x, y) < adaptive)
+                                    continue;
+                                batch_pixels.push_back(y * w + x);
+                                for (int sy = 0; sy < 2; sy++)
+                                    for (int sx = 0; sx < 2; sx++){
+                                        WavefrontPath p;
+                                        p.path.ray = camera_ray(x, y, sx, sy, s, *sampler);
+                                        p.pixel = (uint64_t(y) * w + x) * 4 + sy * 2 + sx;
+                                        p.sample = s;
+                                        batch.push_back(p);
+                                    }
+                            }
+                        if (batch.empty())
+                            break;
+                        wavefront_tracer.trace(batch, *sampler, thread_stats);
+                        for (int k = 0; k < (int) batch_pixels.size(); ++k){
+                            Vec3 colors[Film::SUBPIXELS];
+                            Features features[Film::SUBPIXELS];
+                            for (int j = 0; j < Film::SUBPIXELS; ++j){
+                                colors[j] = batch[k * Film::SUBPIXELS + j].path.color;
+                                features[j] = batch[k * Film::SUBPIXELS + j].features;
+                            }
+                            add_round(batch_pixels[k] % w, batch_pixels[k] / w, colors, features);
+                        }
                     }
-                    color += samp_color.clip() * 0.25;
                 }
-            image.setPixel(x, y, color);
-            // fprintf(stderr, "count %d\n", count);
+                tile_ms[t] += progress.elapsed_ms() - start_ms;
+                progress.add((long long) (tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+            }
+#pragma omp critical
+            stats.add(thread_stats);
+            delete sampler;
+            for (Sampler *s : packet_samplers)
+                delete s;
+            delete packet;
+        }
+        steals += queue.steals();
+        rounds_done = pass_end;
+        if (rounds_done < samps)
+            save_images();
+        if (checkpoint_file != nullptr) {
+            Checkpoint c = {w, h, rounds_done, int32_t(sampler_type), samps, int32_t(nee),
+                            int32_t(light_sampling), min_spp, adaptive, seed, scene_hash};
+            if (!save_checkpoint(checkpoint_file, c, film))
+                fprintf(stderr, "\nCannot write checkpoint %s\n", checkpoint_file);
+        }
+        if (time_limit > 0 && progress.elapsed_ms() > time_limit * 1000 && rounds_done < samps) {
+            fprintf(stderr, "\n[Checkpoint] time limit reached at %d of %d spp%s%s\n",
+                    rounds_done * Film::SUBPIXELS, samps * Film::SUBPIXELS,
+                    checkpoint_file ? ", continue with --resume " : "", checkpoint_file ? checkpoint_file : "");
+            break;
         }
-            
     }
-    image.SaveImage(argv[2]);
+    fprintf(stderr, "\n");
+    stats.print(stderr);
+    double seconds = progress.elapsed_ms() / 1000;
+    fprintf(stderr, "[Render] %.2f s, %.2f Mrays/s (%s)\n", seconds, stats.rays() / seconds * 1e-6,
+            wavefront ? "wavefront" : packets ? "packets" : "depth first");
+    if (preview)
+        fprintf(stderr, "[Render] preview, first hits only\n");
+    print_tile_stats(stderr, tile_ms, tile_size, steals);
+    if (adaptive > 0)
+        fprintf(stderr, "[Adaptive] %.1f spp on average, %.1f%% of the budget\n",
+                double(film.total_samples()) / (w * h),
+                100.0 * film.total_samples() / (double(w) * h * samps * Film::SUBPIXELS));
+    save_images();
     return 0;
 }
\ No newline at end of file
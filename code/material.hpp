@@ -6,6 +6,7 @@
 #include "texture.hpp"
 
 class Material;
+class Object;
 struct Hit
 {
     Vec3 p;
@@ -13,17 +14,42 @@ struct Hit
     double t;
     Material *material;
     double u = 0.0, v = 0.0;
+    // set by Object::intersect for Object::get_surface
+    const Object *obj = nullptr;
+    int prim = 0;             // primitive of obj that was hit
+    double b1 = 0.0, b2 = 0.0;  // barycentrics or surface parameters
 };
 
 
+// Materials draw their random numbers from ray.sampler and pass it on to
+// the scattered ray.
+//
+// scatter returns the sampled direction, its weight (BSDF times cosine
+// over pdf) and the pdf per solid angle, which is 0 for specular (delta)
+// directions.
 class Material
 {
 public:
     virtual bool scatter(const Ray &ray, const Hit &hit,
-                         Vec3 &attenuation, Ray &scattered) const = 0;
+                         Vec3 &attenuation, Ray &scattered, double &pdf) const = 0;
     virtual Vec3 illuminate(double u, double v, const Vec3& p) const {
         return Vec3(0,0,0);
     }
+    virtual bool emits() const { return false; }
+
+    // Next event estimation only samples lights from materials that can
+    // evaluate any direction; the others are treated as specular.
+    virtual bool has_pdf() const { return false; }
+    // whether eval is 0 for every direction below hit.norm
+    virtual bool one_sided() const { return false; }
+    // BSDF times cosine for the direction wi
+    virtual Vec3 eval(const Ray &ray, const Hit &hit, const Vec3 &wi) const { return Vec3(); }
+    // pdf of scatter choosing wi, per solid angle
+    virtual double pdf(const Ray &ray, const Hit &hit, const Vec3 &wi) const { return 0; }
+    // surface color at the hit, in [0, 1], for the denoiser's albedo buffer
+    virtual Vec3 base_color(const Hit &hit) const { return Vec3(1, 1, 1); }
+
+    int id = 0;  // position in the scene file from 1, 0 for built-in materials
 };
 
 
@@ -31,33 +57,78 @@ class Diffuse : public Material
 {
 public:
     Diffuse(Texture* a) : albedo(a) {}
+    // cosine weighted, so the weight is just the albedo
     virtual bool scatter(const Ray &ray, const Hit &hit,
-                         Vec3 &attenuation, Ray &scattered) const
+                         Vec3 &attenuation, Ray &scattered, double &pdf) const
     {
-        Vec3 target = hit.p + hit.norm + random_in_unit_sphere();
-        scattered = Ray(hit.p, (target - hit.p).normalized());
+        double u1, u2;
+        ray.sampler->next_2d(u1, u2);
+        Vec3 local = sample_cosine_hemisphere(u1, u2);
+        scattered = Ray(hit.p, local_to_world(local, hit.norm), ray.time, ray.sampler);
         attenuation = albedo->value(hit.u, hit.v, hit.p);
+        pdf = local.z / PI;
         return true;
     }
+    virtual bool has_pdf() const override { return true; }
+    virtual bool one_sided() const override { return true; }
+    virtual Vec3 eval(const Ray &ray, const Hit &hit, const Vec3 &wi) const override
+    {
+        double cosine = hit.norm.dot(wi);
+        return cosine > 0 ? albedo->value(hit.u, hit.v, hit.p) * (cosine / PI) : Vec3();
+    }
+    virtual double pdf(const Ray &ray, const Hit &hit, const Vec3 &wi) const override
+    {
+        return fmax(hit.norm.dot(wi), 0.0) / PI;
+    }
+    virtual Vec3 base_color(const Hit &hit) const override { return albedo->value(hit.u, hit.v, hit.p).clip(); }
 
     Texture* albedo;
 };
 
+// A mirror, or with fuzz a glossy metal: a normalized Phong lobe around
+// the mirror direction whose exponent 2 / fuzz^2 - 2 goes from a uniform
+// hemisphere at fuzz 1 to a mirror at fuzz 0. The BSDF is the albedo times
+// the lobe, so sampled directions weigh the albedo; those below the
+// surface are absorbed.
 class Specular : public Material
 {
     Texture* albedo;
     double fuzz;
+    double exponent;
 
 public:
-    Specular(Texture* a, double f) : albedo(a), fuzz(clamp(f)) {}
+    Specular(Texture* a, double f) : albedo(a), fuzz(clamp(f)),
+        exponent(fuzz > 0 ? 2 / (fuzz * fuzz) - 2 : 0) {}
     virtual bool scatter(const Ray &ray, const Hit &hit,
-                         Vec3 &attenuation, Ray &scattered) const
+                         Vec3 &attenuation, Ray &scattered, double &pdf) const
     {
         Vec3 reflected = ray.direction().reflect(hit.norm);
-        scattered = Ray(hit.p, reflected + random_in_unit_sphere() * fuzz);
+        pdf = 0;
+        if (fuzz > 0)
+        {
+            double u1, u2;
+            ray.sampler->next_2d(u1, u2);
+            Vec3 local = sample_phong_lobe(exponent, u1, u2);
+            reflected = local_to_world(local, reflected);
+            pdf = phong_lobe_pdf(exponent, local.z);
+        }
+        scattered = Ray(hit.p, reflected, ray.time, ray.sampler);
         attenuation = albedo->value(hit.u, hit.v, hit.p);
         return (scattered.direction().dot(hit.norm) > 0);
     }
+    virtual bool has_pdf() const override { return fuzz > 0; }
+    virtual bool one_sided() const override { return true; }
+    virtual Vec3 eval(const Ray &ray, const Hit &hit, const Vec3 &wi) const override
+    {
+        if (hit.norm.dot(wi) <= 0)
+            return Vec3();
+        return albedo->value(hit.u, hit.v, hit.p) * pdf(ray, hit, wi);
+    }
+    virtual double pdf(const Ray &ray, const Hit &hit, const Vec3 &wi) const override
+    {
+        return phong_lobe_pdf(exponent, ray.direction().reflect(hit.norm).dot(wi));
+    }
+    virtual Vec3 base_color(const Hit &hit) const override { return albedo->value(hit.u, hit.v, hit.p).clip(); }
 };
 
 class Refract : public Material
@@ -86,8 +157,9 @@ class Refract : public Material
 public:
     Refract(double ref, Vec3 c = Vec3(1,1,1)) : ri(ref), color(c) {}
     virtual bool scatter(const Ray &ray, const Hit &hit,
-                         Vec3 &attenuation, Ray &scattered) const
+                         Vec3 &attenuation, Ray &scattered, double &pdf) const
     {
+        pdf = 0;
         Vec3 out_norm;
         Vec3 reflected = ray.direction().reflect(hit.norm);
         double n_relative;
@@ -110,17 +182,18 @@ public:
         if (refract(ray.direction(), out_norm, n_relative, refracted))
         {
             double reflect_prob = schlick(cosine, ri);
-            if (reflect_prob <= drand48())
-                scattered = Ray(hit.p, refracted);
+            if (reflect_prob <= ray.sampler->next())
+                scattered = Ray(hit.p, refracted, ray.time, ray.sampler);
             else
-                scattered = Ray(hit.p, reflected);
+                scattered = Ray(hit.p, reflected, ray.time, ray.sampler);
         }
         else
         {
-            scattered = Ray(hit.p, reflected);
+            scattered = Ray(hit.p, reflected, ray.time, ray.sampler);
         }
         return true;
     }
+    virtual Vec3 base_color(const Hit &hit) const override { return color.clip(); }
 
     double ri;
 };
@@ -130,12 +203,14 @@ class DiffuseLight: public Material{
 public:
     DiffuseLight(Texture *a): emit(a) {}
     virtual bool scatter(const Ray &ray, const Hit &hit,
-                         Vec3 &attenuation, Ray &scattered) const override {
+                         Vec3 &attenuation, Ray &scattered, double &pdf) const override {
         return false;
     }
     virtual Vec3 illuminate(double u, double v, const Vec3& p) const {
         return emit->value(u, v, p);
     }
+    virtual bool emits() const override { return true; }
+    virtual Vec3 base_color(const Hit &hit) const override { return emit->value(hit.u, hit.v, hit.p).clip(); }
 
 };
 
@@ -146,11 +221,24 @@ class Isotropic : public Material {
         Isotropic(Texture* a) : albedo(a) {}
 
         virtual bool scatter(
-            const Ray& r, const Hit& rec, Vec3& attenuation, Ray& scattered) const override {
-            scattered = Ray(rec.p, random_in_unit_sphere(), r.time);
+            const Ray& r, const Hit& rec, Vec3& attenuation, Ray& scattered, double& pdf) const override {
+            double u1, u2;
+            r.sampler->next_2d(u1, u2);
+            scattered = Ray(rec.p, sample_uniform_sphere(u1, u2), r.time, r.sampler);
             attenuation = albedo->value(rec.u, rec.v, rec.p);
+            pdf = 1 / (4 * PI);
             return true;
         }
+        // media are lit by next event estimation like surfaces; the phase
+        // function has no cosine
+        virtual bool has_pdf() const override { return true; }
+        virtual Vec3 eval(const Ray& r, const Hit& rec, const Vec3& wi) const override {
+            return albedo->value(rec.u, rec.v, rec.p) / (4 * PI);
+        }
+        virtual double pdf(const Ray& r, const Hit& rec, const Vec3& wi) const override {
+            return 1 / (4 * PI);
+        }
+        virtual Vec3 base_color(const Hit &rec) const override { return albedo->value(rec.u, rec.v, rec.p).clip(); }
 
     public:
         Texture* albedo = nullptr;
@@ -1,7 +1,10 @@
 #ifndef MESH_H
 #define MESH_H
 #include <vector>
+#include <cstring>
+#include <cfloat>
 #include "shape.hpp"
+#include "bvh.hpp"
 
 
 
@@ -23,6 +26,8 @@ public:
     std::vector<TriangleIndex> t;
     std::vector<Vec3> n;
     virtual bool intersect(const Ray &r, double tmin, double t_max, Hit &h) const override;
+    virtual void get_surface(const Ray &r, Hit &h) const override;
+    virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
     virtual bool bounding_box(double t0, double t1, AABB& box) const override;
     ObjectList* get_all_triangles() {
         ObjectList* tmp_list = new ObjectList();
@@ -62,11 +67,31 @@ bool Mesh::intersect(const Ray &r, double t_min, double t_max, Hit& hit) const {
         if(triangle.intersect(r, t_min, t_max, hit)) {
             result = true;
             t_max = hit.t;
+            hit.obj = this;
+            hit.prim = triId;
         }
     }
     return result;
 }
 
+bool Mesh::occluded(const Ray &r, double t_min, double t_max) const {
+    for (int triId = 0; triId < (int) t.size(); ++triId) {
+        TriangleIndex triIndex = t[triId];
+        Triangle triangle(v[triIndex[0]],
+                          v[triIndex[1]], v[triIndex[2]], material);
+        if (triangle.occluded(r, t_min, t_max))
+            return true;
+    }
+    return false;
+}
+
+void Mesh::get_surface(const Ray &r, Hit& hit) const {
+    hit.p = r.point(hit.t);
+    hit.norm = n[hit.prim];
+    hit.material = material;
+    hit.u = hit.v = 0.0;
+}
+
 bool Mesh::bounding_box(double t0, double t1, AABB& box) const {
     Vec3 minV = v[0], maxV = v[0];
     std::vector<Vec3> vv = v;
@@ -154,4 +179,409 @@ void Mesh::computeNormal() {
         n[triId] = b.normalized();
     }
 }
+
+
+// Triangles of a BVH leaf packed for one SIMD test: vertex 0 and the two
+// edges of up to TRI_BLOCK triangles, as structure of arrays in float.
+// Vertices are stored relative to an origin of the block, and the ray
+// origin is moved there in double, so that float keeps the precision of
+// the triangles' size wherever the mesh lies.
+const int TRI_BLOCK = 8;
+
+struct TriangleBlock {
+    double origin[3];
+    float v0[3][TRI_BLOCK], e1[3][TRI_BLOCK], e2[3][TRI_BLOCK];
+    float size[TRI_BLOCK];  // largest coordinate of v0 and the edges
+};
+
+// The float test only culls, and TriangleMesh re-tests the survivors
+// exactly. Its bounds are widened by a bound of the rounding errors so
+// that it keeps every triangle the double precision test would hit: for
+// a triangle of size s, a ray of direction d and tv from vertex 0 to the
+// ray origin (largest coordinates), the barycentrics are off by at most
+// TRI_BLOCK_ERR * s * |d| * (|tv| + s) / |det| and t by
+// TRI_BLOCK_ERR * s * s * (|tv| + s + |t| * |d|) / |det|. Lanes whose
+// determinant is within its own error, or not finite, are always kept.
+const float TRI_BLOCK_ERR = 128 * (FLT_EPSILON / 2);
+
+// Moller-Trumbore on the first n triangles of `b`, returns a bit mask of
+// the candidates whose distance lies in (t_lo, t_hi)
+inline int tri_block_hit_scalar(const TriangleBlock& b, int n, const double o[3], const float d[3],
+                                float t_lo, float t_hi) {
+    float ob[3] = {float(o[0] - b.origin[0]), float(o[1] - b.origin[1]), float(o[2] - b.origin[2])};
+    float d_max = fmaxf(fabsf(d[0]), fmaxf(fabsf(d[1]), fabsf(d[2])));
+    int mask = 0;
+    for (int i = 0; i < n; ++i) {
+        float e1[3] = {b.e1[0][i], b.e1[1][i], b.e1[2][i]};
+        float e2[3] = {b.e2[0][i], b.e2[1][i], b.e2[2][i]};
+        float tv[3] = {ob[0] - b.v0[0][i], ob[1] - b.v0[1][i], ob[2] - b.v0[2][i]};
+        float p[3] = {d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0]};
+        float q[3] = {tv[1] * e1[2] - tv[2] * e1[1], tv[2] * e1[0] - tv[0] * e1[2], tv[0] * e1[1] - tv[1] * e1[0]};
+        float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+        float inv_det = 1 / det;
+        float b1 = (tv[0] * p[0] + tv[1] * p[1] + tv[2] * p[2]) * inv_det;
+        float b2 = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv_det;
+        float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+        float s = b.size[i];
+        float reach = fmaxf(fabsf(tv[0]), fmaxf(fabsf(tv[1]), fabsf(tv[2]))) + s;
+        float err = TRI_BLOCK_ERR * s * fabsf(inv_det);
+        float eb = err * d_max * reach, et = err * s * (reach + fabsf(t) * d_max);
+        bool unsure = !(fabsf(det) > TRI_BLOCK_ERR * d_max * s * s) || !(fabsf(inv_det) < INFINITY);
+        if (unsure || (b1 >= -eb && b2 >= -eb && b1 + b2 <= 1 + 2 * eb && t + et > t_lo && t - et < t_hi))
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef BVH_X86
+// lanes [first, first + 4) of tri_block_hit_scalar
+inline int tri_block_hit_sse(const TriangleBlock& b, int first, const double o[3], const float d[3],
+                             float t_lo, float t_hi) {
+    __m128 e1[3], e2[3], tv[3], dd[3];
+    for (int a = 0; a < 3; ++a) {
+        e1[a] = _mm_loadu_ps(b.e1[a] + first);
+        e2[a] = _mm_loadu_ps(b.e2[a] + first);
+        tv[a] = _mm_sub_ps(_mm_set1_ps(float(o[a] - b.origin[a])), _mm_loadu_ps(b.v0[a] + first));
+        dd[a] = _mm_set1_ps(d[a]);
+    }
+    const __m128 sign = _mm_set1_ps(-0.0f);
+#define CROSS_SSE(r, x, y, i, j) r[i] = _mm_sub_ps(_mm_mul_ps(x[j], y[3 - i - j]), _mm_mul_ps(x[3 - i - j], y[j]))
+#define DOT_SSE(x, y) _mm_add_ps(_mm_add_ps(_mm_mul_ps(x[0], y[0]), _mm_mul_ps(x[1], y[1])), _mm_mul_ps(x[2], y[2]))
+#define ABS_SSE(x) _mm_andnot_ps(sign, x)
+    __m128 p[3], q[3];
+    CROSS_SSE(p, dd, e2, 0, 1); CROSS_SSE(p, dd, e2, 1, 2); CROSS_SSE(p, dd, e2, 2, 0);
+    CROSS_SSE(q, tv, e1, 0, 1); CROSS_SSE(q, tv, e1, 1, 2); CROSS_SSE(q, tv, e1, 2, 0);
+    __m128 det = DOT_SSE(e1, p);
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1), det);
+    __m128 b1 = _mm_mul_ps(DOT_SSE(tv, p), inv_det);
+    __m128 b2 = _mm_mul_ps(DOT_SSE(dd, q), inv_det);
+    __m128 t = _mm_mul_ps(DOT_SSE(e2, q), inv_det);
+    __m128 s = _mm_loadu_ps(b.size + first);
+    __m128 d_max = _mm_set1_ps(fmaxf(fabsf(d[0]), fmaxf(fabsf(d[1]), fabsf(d[2]))));
+    __m128 reach = _mm_add_ps(_mm_max_ps(ABS_SSE(tv[0]), _mm_max_ps(ABS_SSE(tv[1]), ABS_SSE(tv[2]))), s);
+    __m128 err = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(TRI_BLOCK_ERR), s), ABS_SSE(inv_det));
+    __m128 eb = _mm_mul_ps(_mm_mul_ps(err, d_max), reach);
+    __m128 et = _mm_mul_ps(_mm_mul_ps(err, s), _mm_add_ps(reach, _mm_mul_ps(ABS_SSE(t), d_max)));
+    __m128 det_err = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(TRI_BLOCK_ERR), d_max), _mm_mul_ps(s, s));
+    __m128 unsure = _mm_or_ps(_mm_cmpngt_ps(ABS_SSE(det), det_err),
+                              _mm_cmpnlt_ps(ABS_SSE(inv_det), _mm_set1_ps(INFINITY)));
+#undef CROSS_SSE
+#undef DOT_SSE
+    __m128 lo = _mm_sub_ps(_mm_setzero_ps(), eb);
+    __m128 hi = _mm_add_ps(_mm_set1_ps(1), _mm_add_ps(eb, eb));
+    __m128 ok = _mm_and_ps(_mm_cmpge_ps(b1, lo), _mm_cmpge_ps(b2, lo));
+    ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(b1, b2), hi));
+    ok = _mm_and_ps(ok, _mm_cmpgt_ps(_mm_add_ps(t, et), _mm_set1_ps(t_lo)));
+    ok = _mm_and_ps(ok, _mm_cmplt_ps(_mm_sub_ps(t, et), _mm_set1_ps(t_hi)));
+#undef ABS_SSE
+    return _mm_movemask_ps(_mm_or_ps(ok, unsure)) << first;
+}
+
+__attribute__((target("avx2")))
+int tri_block_hit_avx2(const TriangleBlock& b, const double o[3], const float d[3],
+                       float t_lo, float t_hi) {
+    __m256 e1[3], e2[3], tv[3], dd[3];
+    for (int a = 0; a < 3; ++a) {
+        e1[a] = _mm256_loadu_ps(b.e1[a]);
+        e2[a] = _mm256_loadu_ps(b.e2[a]);
+        tv[a] = _mm256_sub_ps(_mm256_set1_ps(float(o[a] - b.origin[a])), _mm256_loadu_ps(b.v0[a]));
+        dd[a] = _mm256_set1_ps(d[a]);
+    }
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+#define CROSS_AVX(r, x, y, i, j) r[i] = _mm256_sub_ps(_mm256_mul_ps(x[j], y[3 - i - j]), _mm256_mul_ps(x[3 - i - j], y[j]))
+#define DOT_AVX(x, y) _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x[0], y[0]), _mm256_mul_ps(x[1], y[1])), _mm256_mul_ps(x[2], y[2]))
+#define ABS_AVX(x) _mm256_andnot_ps(sign, x)
+    __m256 p[3], q[3];
+    CROSS_AVX(p, dd, e2, 0, 1); CROSS_AVX(p, dd, e2, 1, 2); CROSS_AVX(p, dd, e2, 2, 0);
+    CROSS_AVX(q, tv, e1, 0, 1); CROSS_AVX(q, tv, e1, 1, 2); CROSS_AVX(q, tv, e1, 2, 0);
+    __m256 det = DOT_AVX(e1, p);
+    __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1), det);
+    __m256 b1 = _mm256_mul_ps(DOT_AVX(tv, p), inv_det);
+    __m256 b2 = _mm256_mul_ps(DOT_AVX(dd, q), inv_det);
+    __m256 t = _mm256_mul_ps(DOT_AVX(e2, q), inv_det);
+    __m256 s = _mm256_loadu_ps(b.size);
+    __m256 d_max = _mm256_set1_ps(fmaxf(fabsf(d[0]), fmaxf(fabsf(d[1]), fabsf(d[2]))));
+    __m256 reach = _mm256_add_ps(_mm256_max_ps(ABS_AVX(tv[0]), _mm256_max_ps(ABS_AVX(tv[1]), ABS_AVX(tv[2]))), s);
+    __m256 err = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(TRI_BLOCK_ERR), s), ABS_AVX(inv_det));
+    __m256 eb = _mm256_mul_ps(_mm256_mul_ps(err, d_max), reach);
+    __m256 et = _mm256_mul_ps(_mm256_mul_ps(err, s), _mm256_add_ps(reach, _mm256_mul_ps(ABS_AVX(t), d_max)));
+    __m256 det_err = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(TRI_BLOCK_ERR), d_max), _mm256_mul_ps(s, s));
+    __m256 unsure = _mm256_or_ps(_mm256_cmp_ps(ABS_AVX(det), det_err, _CMP_NGT_UQ),
+                                 _mm256_cmp_ps(ABS_AVX(inv_det), _mm256_set1_ps(INFINITY), _CMP_NLT_UQ));
+#undef CROSS_AVX
+#undef DOT_AVX
+    __m256 lo = _mm256_sub_ps(_mm256_setzero_ps(), eb);
+    __m256 hi = _mm256_add_ps(_mm256_set1_ps(1), _mm256_add_ps(eb, eb));
+    __m256 ok = _mm256_and_ps(_mm256_cmp_ps(b1, lo, _CMP_GE_OQ), _mm256_cmp_ps(b2, lo, _CMP_GE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(b1, b2), hi, _CMP_LE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(t, et), _mm256_set1_ps(t_lo), _CMP_GT_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_sub_ps(t, et), _mm256_set1_ps(t_hi), _CMP_LT_OQ));
+#undef ABS_AVX
+    return _mm256_movemask_ps(_mm256_or_ps(ok, unsure));
+}
+#endif
+
+inline int tri_block_hit(const TriangleBlock& b, int n, const double o[3], const float d[3],
+                         float t_lo, float t_hi) {
+#ifdef BVH_X86
+    int mask;
+    if (BVH_HAS_AVX2)
+        mask = tri_block_hit_avx2(b, o, d, t_lo, t_hi);
+    else
+        mask = tri_block_hit_sse(b, 0, o, d, t_lo, t_hi) | tri_block_hit_sse(b, 4, o, d, t_lo, t_hi);
+    return mask & ((1 << n) - 1);
+#else
+    return tri_block_hit_scalar(b, n, o, d, t_lo, t_hi);
+#endif
+}
+
+
+// Triangle mesh intersected through a BVH over triangle indices. Vertices
+// and indices stay in two shared buffers, no object is created per face.
+// The buffers are either owned or point into a mapped cache file.
+class TriangleMesh : public Object {
+public:
+    // takes the vertices and triangles of `mesh`, reordering the triangles
+    // into BVH leaf order
+    TriangleMesh(Mesh& mesh, const BVHOptions& opt) {
+        material = mesh.material;
+        BVHOptions mesh_opt = opt;
+        mesh_opt.leaf_block = TRI_BLOCK;
+        mesh_opt.max_leaf = std::max(opt.max_leaf, TRI_BLOCK);
+        auto begin = std::chrono::steady_clock::now();
+        v_storage.swap(mesh.v);
+        std::vector<Mesh::TriangleIndex> tris;
+        tris.swap(mesh.t);
+        std::vector<BVHPrimitive> prims(tris.size());
+#pragma omp parallel for
+        for (int i = 0; i < (int) tris.size(); ++i) {
+            const int* idx = tris[i].x;
+            Vec3 minV = v_storage[idx[0]], maxV = minV;
+            for (int k = 1; k < 3; ++k) {
+                for (int a = 0; a < 3; ++a) {
+                    minV[a] = fmin(minV[a], v_storage[idx[k]][a]);
+                    maxV[a] = fmax(maxV[a], v_storage[idx[k]][a]);
+                }
+            }
+            prims[i].obj = nullptr;
+            prims[i].index = i;
+            prims[i].box = AABB(minV, maxV);
+            prims[i].centroid = prims[i].box.centroid();
+        }
+        bvh.init(bvh_build_linear(prims, mesh_opt), opt.layout);
+        t_storage.resize(prims.size());
+        for (int i = 0; i < (int) prims.size(); ++i)
+            t_storage[i] = tris[prims[i].index];
+        v = v_storage.data();
+        t = t_storage.data();
+        n_verts = int(v_storage.size());
+        n_tris = int(t_storage.size());
+        build_blocks();
+        build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    // uses buffers built earlier, e.g. mapped from a cache file; nothing is
+    // copied and the buffers must outlive the mesh
+    TriangleMesh(const LinearBVHNode* nodes, int n_nodes, const Vec3* v_, int n_verts_,
+                 const Mesh::TriangleIndex* t_, int n_tris_, Material* m, BVHLayout layout)
+        : v(v_), t(t_), n_verts(n_verts_), n_tris(n_tris_) {
+        material = m;
+        bvh.init(nodes, n_nodes, layout);
+        build_blocks();
+    }
+
+    virtual bool intersect(const Ray& r, double t_min, double t_max, Hit& hit) const override {
+        int closest = -1;
+        double o[3] = {r.o.x, r.o.y, r.o.z};
+        float d[3] = {float(r.d.x), float(r.d.y), float(r.d.z)};
+        bvh.traverse(r, t_min, t_max, [&](int offset, int n, double& t_max) {
+            return intersect_leaf(offset, n, r, o, d, t_min, t_max, closest);
+        });
+        if (closest < 0)
+            return false;
+        hit.t = t_max;
+        hit.obj = this;
+        hit.prim = closest;
+        return true;
+    }
+
+    virtual void intersect_packet(RayPacket& p, int first) const override {
+        bvh.traverse_packet(p, first, [&](const LinearBVHNode& node, int first,
+                                          const double* lo, const double* hi) {
+            for (uint64_t mask = packet_hit_mask(p, lo, hi, first); mask; mask &= mask - 1) {
+                int k = __builtin_ctzll(mask);
+                const Ray& r = p.rays[k];
+                double o[3] = {r.o.x, r.o.y, r.o.z};
+                float d[3] = {float(r.d.x), float(r.d.y), float(r.d.z)};
+                int closest = -1;
+                if (intersect_leaf(node.offset, node.n_prims, r, o, d, p.t_min, p.t_max[k], closest)) {
+                    p.hits[k].t = p.t_max[k];
+                    p.hits[k].obj = this;
+                    p.hits[k].prim = closest;
+                    p.found[k] = true;
+                }
+            }
+        });
+    }
+
+    virtual bool occluded(const Ray& r, double t_min, double t_max) const override {
+        double o[3] = {r.o.x, r.o.y, r.o.z};
+        float d[3] = {float(r.d.x), float(r.d.y), float(r.d.z)};
+        float t_lo = round_down(t_min);
+        float t_hi = round_up(t_max);
+        return bvh.traverse(r, t_min, t_max, [&](int offset, int n, double& t_max) {
+            const TriangleBlock* b = &blocks[leaf_block[offset]];
+            for (int first = offset; first < offset + n; first += TRI_BLOCK, ++b) {
+                int mask = tri_block_hit(*b, std::min(TRI_BLOCK, offset + n - first), o, d, t_lo, t_hi);
+                for (; mask; mask &= mask - 1) {
+                    double tt;
+                    if (intersect_triangle(first + __builtin_ctz(mask), r, t_min, t_max, tt))
+                        return true;
+                }
+            }
+            return false;
+        }, true);
+    }
+
+    // every triangle the line meets, in one traversal that never lowers
+    // its t_max
+    virtual void crossings(const Ray& r, Crossings& c) const override {
+        double o[3] = {r.o.x, r.o.y, r.o.z};
+        float d[3] = {float(r.d.x), float(r.d.y), float(r.d.z)};
+        double t_max = INFINITY;
+        bvh.traverse(r, -INFINITY, t_max, [&](int offset, int n, double&) {
+            const TriangleBlock* b = &blocks[leaf_block[offset]];
+            for (int first = offset; first < offset + n; first += TRI_BLOCK, ++b) {
+                int mask = tri_block_hit(*b, std::min(TRI_BLOCK, offset + n - first), o, d, -INFINITY, INFINITY);
+                for (; mask; mask &= mask - 1) {
+                    double tt;
+                    if (intersect_triangle(first + __builtin_ctz(mask), r, -INFINITY, INFINITY, tt))
+                        c.add(tt);
+                }
+            }
+            return false;
+        });
+        c.merge();
+    }
+
+    virtual void get_surface(const Ray& r, Hit& hit) const override {
+        const int* idx = t[hit.prim].x;
+        hit.p = r.point(hit.t);
+        hit.norm = ((v[idx[1]] - v[idx[0]]) % (v[idx[2]] - v[idx[0]])).normalized();
+        hit.material = material;
+        hit.u = hit.v = 0.0;
+    }
+
+    virtual bool bounding_box(double t0, double t1, AABB& box) const override {
+        if (bvh.n_nodes == 0)
+            return false;
+        box = bvh_root_box(bvh.nodes);
+        return true;
+    }
+
+    // Triangles [offset, offset + n) of a leaf against r, whose o and d
+    // are given as the block test takes them, o in double and d in float.
+    // Lowers t_max to the closest hit and sets `closest` to its triangle.
+    bool intersect_leaf(int offset, int n, const Ray& r, const double o[3], const float d[3],
+                        double t_min, double& t_max, int& closest) const {
+        bool found = false;
+        float t_lo = round_down(t_min);
+        float t_hi = round_up(t_max);
+        const TriangleBlock* b = &blocks[leaf_block[offset]];
+        for (int first = offset; first < offset + n; first += TRI_BLOCK, ++b) {
+            int mask = tri_block_hit(*b, std::min(TRI_BLOCK, offset + n - first), o, d, t_lo, t_hi);
+            for (; mask; mask &= mask - 1) {
+                int i = first + __builtin_ctz(mask);
+                double tt;
+                if (intersect_triangle(i, r, t_min, t_max, tt)) {
+                    t_max = tt;
+                    closest = i;
+                    found = true;
+                }
+            }
+        }
+        return found;
+    }
+
+    // Moller-Trumbore
+    bool intersect_triangle(int i, const Ray& r, double t_min, double t_max, double& tt) const {
+        const int* idx = t[i].x;
+        const Vec3& v0 = v[idx[0]];
+        Vec3 e1 = v[idx[1]] - v0, e2 = v[idx[2]] - v0;
+        Vec3 pvec = r.d % e2;
+        double det = e1.dot(pvec);
+        if (det == 0.0)
+            return false;
+        double inv_det = 1 / det;
+        Vec3 tvec = r.o - v0;
+        double b1 = tvec.dot(pvec) * inv_det;
+        if (b1 < 0 || b1 > 1)
+            return false;
+        Vec3 qvec = tvec % e1;
+        double b2 = r.d.dot(qvec) * inv_det;
+        if (b2 < 0 || b1 + b2 > 1)
+            return false;
+        tt = e2.dot(qvec) * inv_det;
+        return tt > t_min && tt < t_max;
+    }
+
+    double cost(double leaf_cost) const { return bvh_cost(bvh.nodes, leaf_cost, TRI_BLOCK); }
+    size_t memory() const {
+        return size_t(n_verts) * sizeof(Vec3) + size_t(n_tris) * sizeof(Mesh::TriangleIndex)
+             + bvh.memory() + blocks.size() * sizeof(TriangleBlock) + leaf_block.size() * sizeof(int);
+    }
+
+    BVHNodes bvh;
+    const Vec3* v = nullptr;
+    const Mesh::TriangleIndex* t = nullptr;  // in BVH leaf order
+    int n_verts = 0, n_tris = 0;
+    double build_time = 0;  // seconds
+
+private:
+    std::vector<Vec3> v_storage;
+    std::vector<Mesh::TriangleIndex> t_storage;
+    std::vector<TriangleBlock> blocks;  // each leaf starts a new block
+    std::vector<int> leaf_block;        // first block of the leaf starting at a triangle
+
+    void build_blocks() {
+        leaf_block.assign(n_tris, -1);
+        blocks.clear();
+        for (int k = 0; k < bvh.n_nodes; ++k) {
+            const LinearBVHNode& node = bvh.nodes[k];
+            if (node.n_prims == 0)
+                continue;
+            leaf_block[node.offset] = int(blocks.size());
+            for (int first = node.offset; first < node.offset + node.n_prims; first += TRI_BLOCK) {
+                TriangleBlock b;
+                memset(&b, 0, sizeof(b));
+                int count = std::min(TRI_BLOCK, node.offset + node.n_prims - first);
+                // the center of the block's vertices 0
+                Vec3 lo = v[t[first].x[0]], hi = lo;
+                for (int i = 1; i < count; ++i)
+                    for (int a = 0; a < 3; ++a) {
+                        lo[a] = fmin(lo[a], v[t[first + i].x[0]][a]);
+                        hi[a] = fmax(hi[a], v[t[first + i].x[0]][a]);
+                    }
+                Vec3 origin = (lo + hi) * 0.5;
+                for (int a = 0; a < 3; ++a)
+                    b.origin[a] = origin[a];
+                for (int i = 0; i < count; ++i) {
+                    const int* idx = t[first + i].x;
+                    Vec3 v0 = v[idx[0]] - origin, e1 = v[idx[1]] - v[idx[0]], e2 = v[idx[2]] - v[idx[0]];
+                    double size = 0;
+                    for (int a = 0; a < 3; ++a) {
+                        b.v0[a][i] = float(v0[a]);
+                        b.e1[a][i] = float(e1[a]);
+                        b.e2[a][i] = float(e2[a]);
+                        size = fmax(size, fmax(fabs(v0[a]), fmax(fabs(e1[a]), fabs(e2[a]))));
+                    }
+                    // rounded up, the error bounds scale with it
+                    b.size[i] = round_up(size);
+                }
+                blocks.push_back(b);
+            }
+        }
+    }
+};
+
 #endif
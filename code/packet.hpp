@@ -0,0 +1,69 @@
+#ifndef __PACKET_H__
+#define __PACKET_H__
+
+#include "utils.hpp"
+#include "ray.hpp"
+#include "material.hpp"
+#include <cmath>
+
+const int PACKET_SIZE = 64;
+
+// Rays traced through the scene together, such as the camera rays of a
+// block of pixels. BVHs visit a node once for the whole packet instead
+// of once per ray (see bvh_traverse_packet); origins and reciprocal
+// directions are kept as structure of arrays for the box tests, which
+// check four rays at a time.
+struct RayPacket
+{
+    int n = 0;
+    Ray rays[PACKET_SIZE];
+    Hit hits[PACKET_SIZE];
+    double t_min = 0.001;
+    double t_max[PACKET_SIZE];
+    bool found[PACKET_SIZE];
+    double org[3][PACKET_SIZE], inv[3][PACKET_SIZE];
+    // Bounds of the origins and reciprocal directions, for culling a box
+    // against the whole packet; only valid when `coherent`: the direction
+    // signs agree along every axis and no component is zero.
+    bool coherent;
+    double o_lo[3], o_hi[3], inv_lo[3], inv_hi[3], t_max_all;
+
+    void clear() { n = 0; }
+    void add(const Ray &r, double t_max_)
+    {
+        rays[n] = r;
+        hits[n] = Hit();
+        t_max[n] = t_max_;
+        found[n] = false;
+        ++n;
+    }
+
+    // call once all rays are added
+    void prepare()
+    {
+        coherent = n > 0;
+        t_max_all = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            t_max_all = fmax(t_max_all, t_max[i]);
+            for (int a = 0; a < 3; ++a)
+            {
+                org[a][i] = rays[i].o[a];
+                inv[a][i] = 1 / rays[i].d[a];
+                if (i == 0)
+                {
+                    o_lo[a] = o_hi[a] = org[a][0];
+                    inv_lo[a] = inv_hi[a] = inv[a][0];
+                }
+                o_lo[a] = fmin(o_lo[a], org[a][i]);
+                o_hi[a] = fmax(o_hi[a], org[a][i]);
+                inv_lo[a] = fmin(inv_lo[a], inv[a][i]);
+                inv_hi[a] = fmax(inv_hi[a], inv[a][i]);
+                if ((inv[a][i] < 0) != (inv[a][0] < 0) || std::isinf(inv[a][i]))
+                    coherent = false;
+            }
+        }
+    }
+};
+
+#endif
@@ -7,13 +7,15 @@ struct Ray
 {
     Vec3 o, d;
     double time;
+    Sampler *sampler = nullptr; // random numbers of the path, for materials and media
 
     Ray() = default;
-    Ray(const Vec3 &o_, const Vec3 &d_, double t = 0.0)
+    Ray(const Vec3 &o_, const Vec3 &d_, double t = 0.0, Sampler *s = nullptr)
     {
         o = o_;
         d = d_.normalized();
         time = t;
+        sampler = s;
     }
     Vec3 point(double t) const { return o + d * t; }
     Vec3 origin() const { return o; }
@@ -23,16 +25,6 @@ struct Ray
 
 class Camera
 {
-    Vec3 random_in_unit_disk()
-    {
-        Vec3 res;
-        do
-        {
-            res = Vec3(drand48(), drand48(), 0) * 2 - Vec3(1, 1, 0) ;
-        } while (res.len() >= 1);
-        return res;
-    }
-
 public:
     Camera(int width_, int height_, Vec3 from, Vec3 at, Vec3 vup, double theta,
            double aperture, double focus_dist, double t0, double t1)
@@ -50,13 +42,15 @@ public:
         lower_left = origin - horiz / 2 - verti / 2 - w * focus_dist;
         lens_radius = aperture / 2;
     }
-    Ray generate_ray(double hor, double ver)
+    Ray generate_ray(double hor, double ver, Sampler &sampler)
     {
-        Vec3 random_coff = random_in_unit_disk() * lens_radius;
+        double u1, u2;
+        sampler.next_2d(u1, u2);
+        Vec3 random_coff = sample_concentric_disk(u1, u2) * lens_radius;
         Vec3 r_vec = u * random_coff.x + v * random_coff.y;
-        double time = time0 + (time1 - time0) * drand48();
+        double time = time0 + (time1 - time0) * sampler.next();
         return Ray(origin + r_vec, 
-            lower_left + horiz * hor + verti * ver - origin - r_vec, time);
+            lower_left + horiz * hor + verti * ver - origin - r_vec, time, &sampler);
     }
 
     Vec3 origin;
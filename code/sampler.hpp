@@ -0,0 +1,295 @@
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+
+// 64 bit finalizer, for seeds derived from pixels and dimensions
+inline uint64_t mix_bits(uint64_t v)
+{
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ull;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= v >> 33;
+    return v;
+}
+
+inline uint32_t hash_dimension(uint64_t seed, int dim)
+{
+    return uint32_t(mix_bits(seed ^ (uint64_t(dim + 1) * 0x9e3779b97f4a7c15ull)));
+}
+
+// uniform in [0, 1) with 53 random bits, a pure function of seed and dim
+inline double hash_uniform(uint64_t seed, int dim)
+{
+    uint64_t h = mix_bits(seed ^ (uint64_t(dim + 1) * 0xd1b54a32d192ed03ull));
+    return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Element i of a random permutation of [0, l) chosen by p (Kensler,
+// "Correlated Multi-Jittered Sampling").
+inline uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+    x = __builtin_bswap32(x);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+// Every bit of the result depends only on the bits of x below it.
+inline uint32_t laine_karras(uint32_t x, uint32_t seed)
+{
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return x;
+}
+
+// Owen scrambling of the bits of x, hashed instead of stored (Burley,
+// "Practical Hash-based Owen Scrambling").
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+    return reverse_bits(laine_karras(reverse_bits(x), seed));
+}
+
+// Second Sobol dimension; the first is reverse_bits(index), together they
+// are a (0, 2)-sequence. The generator matrix is applied a byte at a time.
+inline uint32_t sobol_dim1(uint32_t index)
+{
+    struct Table
+    {
+        uint32_t t[4][256];
+        Table()
+        {
+            uint32_t v[32];
+            v[0] = 1u << 31;
+            for (int i = 1; i < 32; ++i)
+                v[i] = v[i - 1] ^ (v[i - 1] >> 1);
+            for (int b = 0; b < 4; ++b)
+                for (int x = 0; x < 256; ++x)
+                {
+                    t[b][x] = 0;
+                    for (int i = 0; i < 8; ++i)
+                        if (x >> i & 1)
+                            t[b][x] ^= v[b * 8 + i];
+                }
+        }
+    };
+    static const Table table;
+    return table.t[0][index & 255] ^ table.t[1][index >> 8 & 255]
+         ^ table.t[2][index >> 16 & 255] ^ table.t[3][index >> 24];
+}
+
+enum SamplerType { SAMPLER_INDEPENDENT, SAMPLER_STRATIFIED, SAMPLER_SOBOL };
+
+// Dimensions of a path sample. The camera draws the first ones in order:
+// pixel offset (2D), lens (2D) and shutter time; every bounce then starts
+// its own block, so the same decision of different samples of a pixel
+// always reads the same dimension.
+const int SAMPLER_CAMERA_DIMS = 5;
+const int SAMPLER_BOUNCE_DIMS = 8;
+
+// Source of the random numbers of a render. A sampler belongs to one
+// thread; it is moved to a pixel with start_pixel, to one of its samples
+// with start_sample, and then hands out successive dimensions of that
+// sample. The numbers are a pure function of the seed, pixel, sample
+// index and dimension, so images do not depend on how pixels are spread
+// over threads, in which order their samples are taken, or on a path
+// being suspended and resumed with set_dimension(dimension()).
+class Sampler
+{
+public:
+    Sampler(uint64_t seed_) : seed(seed_) {}
+    virtual ~Sampler() {}
+
+    void start_pixel(uint64_t pixel_)
+    {
+        pixel = pixel_;
+        pixel_seed = mix_bits(seed ^ mix_bits(pixel_));
+    }
+    virtual void start_sample(int index_)
+    {
+        index = index_;
+        dim = 0;
+    }
+    // continue from dimension d
+    void set_dimension(int d) { dim = d; }
+    int dimension() const { return dim; }
+
+    // Seed of a stream of uniforms at the current dimension, for draws
+    // that need no bound on their number; `key` tells apart the streams
+    // of one dimension. Takes no dimension of the sample.
+    uint64_t stream_seed(uint64_t key) const
+    {
+        return mix_bits(mix_bits(pixel_seed + uint64_t(index)) ^ mix_bits((uint64_t(dim) << 32) ^ key));
+    }
+
+    // the next dimension, uniform in [0, 1)
+    virtual double next() = 0;
+    // the next two dimensions, stratified together where the sampler can
+    virtual void next_2d(double &u1, double &u2)
+    {
+        u1 = next();
+        u2 = next();
+    }
+
+protected:
+    uint64_t seed, pixel = 0, pixel_seed = 0;
+    int index = 0, dim = 0;
+};
+
+// Uncorrelated numbers, hashed from the sample and dimension.
+class IndependentSampler : public Sampler
+{
+public:
+    IndependentSampler(uint64_t seed_ = 0) : Sampler(seed_) {}
+
+    virtual void start_sample(int i) override
+    {
+        Sampler::start_sample(i);
+        sample_seed = mix_bits(pixel_seed + uint64_t(i));
+    }
+    virtual double next() override
+    {
+        return hash_uniform(sample_seed, dim++);
+    }
+
+private:
+    uint64_t sample_seed = 0;
+};
+
+// Jittered strata, spp of them per dimension and an nx x ny grid for
+// pairs of dimensions, shuffled independently per dimension so that
+// dimensions do not correlate. nx is the largest divisor of spp that is
+// at most its square root; prime sample counts are only stratified
+// along one axis of a pair.
+class StratifiedSampler : public Sampler
+{
+public:
+    StratifiedSampler(uint64_t seed_, int spp_) : Sampler(seed_), spp(spp_ > 0 ? spp_ : 1)
+    {
+        nx = int(sqrt(double(spp)));
+        while (spp % nx)
+            --nx;
+        ny = spp / nx;
+    }
+
+    virtual void start_sample(int i) override
+    {
+        Sampler::start_sample(i);
+        sample_seed = mix_bits(pixel_seed + uint64_t(i));
+    }
+    virtual double next() override
+    {
+        uint32_t stratum = permute(index % spp, spp, hash_dimension(pixel_seed, dim));
+        double jitter = hash_uniform(sample_seed, dim++);
+        return (stratum + jitter) / spp;
+    }
+    virtual void next_2d(double &u1, double &u2) override
+    {
+        uint32_t stratum = permute(index % spp, spp, hash_dimension(pixel_seed, dim));
+        u1 = (stratum % nx + hash_uniform(sample_seed, dim)) / nx;
+        u2 = (stratum / nx + hash_uniform(sample_seed, dim + 1)) / ny;
+        dim += 2;
+    }
+
+private:
+    uint64_t sample_seed = 0;
+    int spp, nx, ny;
+};
+
+// Owen scrambled Sobol points. Every dimension pair is a scrambled
+// (0, 2)-sequence whose sample order is shuffled per pair, which pads
+// well-stratified 2D sets together (Burley 2020). Best with power of
+// two sample counts.
+class SobolSampler : public Sampler
+{
+public:
+    SobolSampler(uint64_t seed_ = 0) : Sampler(seed_) {}
+
+    // owen_scramble(reverse_bits(i)) below is written out as
+    // reverse_bits(laine_karras(i)), the inner reversals cancel
+    virtual double next() override
+    {
+        uint32_t h = hash_dimension(pixel_seed, dim++);
+        uint32_t i = owen_scramble(uint32_t(index), h);
+        return to_unit(reverse_bits(laine_karras(i, h ^ 0xa511e9b3)));
+    }
+    virtual void next_2d(double &u1, double &u2) override
+    {
+        uint32_t h = hash_dimension(pixel_seed, dim);
+        dim += 2;
+        uint32_t i = owen_scramble(uint32_t(index), h);
+        u1 = to_unit(reverse_bits(laine_karras(i, h ^ 0xa511e9b3)));
+        u2 = to_unit(owen_scramble(sobol_dim1(i), h ^ 0x63d83595));
+    }
+
+private:
+    static double to_unit(uint32_t x) { return x * (1.0 / 4294967296.0); }
+};
+
+inline bool parse_sampler_type(const char *name, SamplerType &type)
+{
+    if (!strcmp(name, "independent"))
+        type = SAMPLER_INDEPENDENT;
+    else if (!strcmp(name, "stratified"))
+        type = SAMPLER_STRATIFIED;
+    else if (!strcmp(name, "sobol"))
+        type = SAMPLER_SOBOL;
+    else
+        return false;
+    return true;
+}
+
+// spp is the number of samples taken per pixel
+inline Sampler *make_sampler(SamplerType type, uint64_t seed, int spp)
+{
+    switch (type)
+    {
+    case SAMPLER_INDEPENDENT:
+        return new IndependentSampler(seed);
+    case SAMPLER_STRATIFIED:
+        return new StratifiedSampler(seed, spp);
+    default:
+        return new SobolSampler(seed);
+    }
+}
+
+#endif
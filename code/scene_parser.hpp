@@ -9,9 +9,12 @@
 #include "mesh.hpp"
 #include "bbox.hpp"
 #include "bvh.hpp"
+#include "bvh_cache.hpp"
 #include "curve.hpp"
 #include <vector>
 #include "constant_medium.hpp"
+#include "grid_medium.hpp"
+#include "lights.hpp"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "external/stb_image.h"
@@ -60,11 +63,29 @@ public:
         return group;
     }
 
+    // the top level acceleration structure over the Group, use this for rendering
+    Object *getScene() const {
+        return scene;
+    }
+
+    // the emitters next event estimation samples
+    const LightList &getLights() const {
+        return lights;
+    }
+
+    // the media shadow rays pass through
+    const std::vector<const Medium*> &getMedia() const {
+        return media;
+    }
+
 private:
 
     void parseFile();
+    void buildScene();
+    void collectObjects(ObjectList *list, std::vector<Object*>& bounded, ObjectList *unbounded);
     void parseCamera();
     void parseBackground();
+    void parseAccelerator();
     // void parseLights();
     // Light *parsePointLight();
     // Light *parseDirectionalLight();
@@ -88,6 +109,7 @@ private:
     RevSurface *parseRevSurface();
     Curve *parseBezierCurve(const Vec3& scale);
     ConstantMedium* parseMedium();
+    GridMedium* parseGridMedium();
 
     // Transform *parseTransform();
 
@@ -107,6 +129,11 @@ private:
     Material **materials;
     Material *current_material;
     ObjectList *group;
+    Object *scene;
+    BVHOptions bvh_options;
+    std::string bvh_cache_dir;  // empty when the mesh BVH cache is off
+    LightList lights;
+    std::vector<const Medium*> media;
 };
 
 inline double DegreesToRadians(double x) {
@@ -117,6 +144,7 @@ SceneParser::SceneParser(const char *filename) {
 
     // initialize some reasonable default values
     group = nullptr;
+    scene = nullptr;
     camera = nullptr;
     background_color = Vec3();
     // num_lights = 0;
@@ -124,6 +152,7 @@ SceneParser::SceneParser(const char *filename) {
     num_materials = 0;
     materials = nullptr;
     current_material = nullptr;
+    bvh_cache_dir = "bvh_cache";
 
     // parse the file
     assert(filename != nullptr);
@@ -139,9 +168,13 @@ SceneParser::SceneParser(const char *filename) {
         printf("cannot open scene file\n");
         exit(0);
     }
+    auto begin = std::chrono::steady_clock::now();
     parseFile();
     fclose(file);
     file = nullptr;
+    buildScene();
+    fprintf(stderr, "Scene loaded in %.3f s\n",
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
 
     // if (num_lights == 0) {
     //     printf("WARNING:    No lights specified\n");
@@ -179,6 +212,8 @@ void SceneParser::parseFile() {
             parseCamera();
         } else if (!strcmp(token, "Background")) {
             parseBackground();
+        } else if (!strcmp(token, "Accelerator")) {
+            parseAccelerator();
         } 
         // else if (!strcmp(token, "Lights")) {
         //     parseLights();
@@ -197,6 +232,70 @@ void SceneParser::parseFile() {
 // ====================================================================
 // ====================================================================
 
+void SceneParser::collectObjects(ObjectList *list, std::vector<Object*>& bounded,
+                                 ObjectList *unbounded) {
+    AABB box;
+    for (int i = 0; i < list->size(); ++i) {
+        Object *obj = (*list)[i];
+        ObjectList *sub = dynamic_cast<ObjectList *>(obj);
+        if (obj->samplable() && obj->material && obj->material->emits())
+            lights.add(obj);
+        if (Medium *medium = dynamic_cast<Medium *>(obj))
+            media.push_back(medium);
+        if (sub) {
+            // nested groups are flattened into the top level
+            collectObjects(sub, bounded, unbounded);
+            continue;
+        }
+        // ids in scene order, for the object id AOV
+        obj->set_id(int(bounded.size()) + unbounded->size() + 1);
+        if (obj->bounding_box(camera->time0, camera->time1, box)) {
+            bounded.push_back(obj);
+        } else {
+            unbounded->add(obj);
+        }
+    }
+}
+
+void SceneParser::buildScene() {
+    //
+    // two level hierarchy: a BVH over every object of the group, with the
+    // mesh BVHs as its leaves. Objects without a bounding box are tested
+    // separately.
+    //
+    if (group == nullptr) {
+        scene = group = new ObjectList();
+        return;
+    }
+    if (camera == nullptr) {
+        printf("Camera must be specified before building the scene\n");
+        exit(0);
+    }
+    std::vector<Object*> bounded;
+    ObjectList *unbounded = new ObjectList();
+    collectObjects(group, bounded, unbounded);
+    lights.build();
+    Object *top;
+    if (bvh_options.layout == BVH_TREE && !bounded.empty()) {
+        top = new BVH_node(bounded, 0, int(bounded.size()), camera->time0, camera->time1, bvh_options);
+    } else {
+        top = new LinearBVH(bounded, camera->time0, camera->time1, bvh_options);
+    }
+    LinearBVH *linear = dynamic_cast<LinearBVH *>(top);
+    fprintf(stderr, "[BVH] top level: %d objects, %d without bounding box, built in %.1f ms\n",
+            int(bounded.size()), unbounded->size(), linear ? linear->build_time * 1000 : 0.0);
+    fprintf(stderr, "[Lights] %d emitters for next event estimation\n", lights.size());
+    if (!media.empty())
+        fprintf(stderr, "[Media] %d media\n", int(media.size()));
+    if (unbounded->size() == 0) {
+        delete unbounded;
+        scene = top;
+    } else {
+        unbounded->add(top);
+        scene = unbounded;
+    }
+}
+
 void SceneParser::parseCamera() {
     fprintf(stderr, "start camera\n");
     char token[MAX_PARSER_TOKEN_LENGTH];
@@ -259,6 +358,56 @@ void SceneParser::parseBackground() {
     }
 }
 
+void SceneParser::parseAccelerator() {
+    char token[MAX_PARSER_TOKEN_LENGTH];
+    // read in the BVH build parameters, must come before the Group
+    getToken(token);
+    assert (!strcmp(token, "{"));
+    while (true) {
+        getToken(token);
+        if (!strcmp(token, "}")) {
+            break;
+        } else if (!strcmp(token, "builder")) {
+            getToken(token);
+            if (!strcmp(token, "SAH")) {
+                bvh_options.builder = BVH_SAH;
+            } else if (!strcmp(token, "middle")) {
+                bvh_options.builder = BVH_MIDDLE;
+            } else {
+                printf("Unknown BVH builder: '%s'\n", token);
+                exit(0);
+            }
+        } else if (!strcmp(token, "layout")) {
+            getToken(token);
+            if (!strcmp(token, "linear")) {
+                bvh_options.layout = BVH_LINEAR;
+            } else if (!strcmp(token, "tree")) {
+                bvh_options.layout = BVH_TREE;
+            } else if (!strcmp(token, "wide4")) {
+                bvh_options.layout = BVH_WIDE4;
+            } else if (!strcmp(token, "wide8")) {
+                bvh_options.layout = BVH_WIDE8;
+            } else {
+                printf("Unknown BVH layout: '%s'\n", token);
+                exit(0);
+            }
+        } else if (!strcmp(token, "cache")) {
+            // directory for cached mesh BVHs, or "off"
+            getToken(token);
+            bvh_cache_dir = strcmp(token, "off") ? token : "";
+        } else if (!strcmp(token, "bins")) {
+            bvh_options.bins = readInt();
+        } else if (!strcmp(token, "leafCost")) {
+            bvh_options.leaf_cost = readDouble();
+        } else if (!strcmp(token, "maxLeaf")) {
+            bvh_options.max_leaf = readInt();
+        } else {
+            printf("Unknown token in parseAccelerator: '%s'\n", token);
+            assert(0);
+        }
+    }
+}
+
 // ====================================================================
 // ====================================================================
 
@@ -334,6 +483,7 @@ void SceneParser::parseMaterials() {
     int count = 0;
     while (num_materials > count) {
         getToken(token);
+        materials[count] = nullptr;
         if (!strcmp(token, "Diffuse")) {
             materials[count] = parseDiffuse();
         } else if (!strcmp(token, "Specular")){
@@ -343,6 +493,8 @@ void SceneParser::parseMaterials() {
         } else if (!strcmp(token, "DiffuseLight")) {
             materials[count] = parseDiffuseLight();
         } 
+        if (materials[count] != nullptr)
+            materials[count]->id = count + 1;
         count++;
     }
     getToken(token);
@@ -610,6 +762,9 @@ Object *SceneParser::parseObject(char token[MAX_PARSER_TOKEN_LENGTH]) {
     }
     else if (!strcmp(token, "Medium")) {
         answer = (Object *) parseMedium();
+    }
+    else if (!strcmp(token, "GridMedium")) {
+        answer = (Object *) parseGridMedium();
     } 
     else {
         printf("Unknown token in parseObject: '%s'\n", token);
@@ -774,12 +929,43 @@ Object *SceneParser::parseTriangleMesh() {
     }
     const char *ext = &filename[strlen(filename) - 4];
     assert(!strcmp(ext, ".obj"));
-    Mesh *answer = new Mesh(filename, current_material, center, scale, rotate_Y);
-    ObjectList* tris = answer->get_all_triangles();
-    std::vector<Object*> li = tris->getList();
-    BVH_node* root = new BVH_node(li, 0, int(li.size()), 0, 0);
+    uint64_t key;
+    std::string cache_path;
+    bool use_cache = bvh_options.layout != BVH_TREE && !bvh_cache_dir.empty()
+                  && mesh_cache_key(filename, center, scale, rotate_Y, bvh_options, key);
+    if (use_cache) {
+        cache_path = mesh_cache_path(bvh_cache_dir, key);
+        MeshCache cache;
+        if (load_mesh_cache(cache_path, key, cache)) {
+            fprintf(stderr, "[BVH] %s: %d triangles, loaded from %s\n", filename,
+                    cache.n_tris, cache_path.c_str());
+            return new TriangleMesh(cache.nodes, cache.n_nodes, cache.v, cache.n_verts,
+                                    cache.t, cache.n_tris, current_material, bvh_options.layout);
+        }
+    }
+    Mesh mesh(filename, current_material, center, scale, rotate_Y);
+    if (mesh.t.empty())
+        return new ObjectList();
+    const char* builder = bvh_options.builder == BVH_SAH ? "SAH" : "middle";
+    if (bvh_options.layout == BVH_TREE) {
+        // the list only carries the triangles over to the tree
+        ObjectList* triangles = mesh.get_all_triangles();
+        std::vector<Object*> li = triangles->getList();
+        delete triangles;
+        BVH_node* root = new BVH_node(li, 0, int(li.size()), 0, 0, bvh_options);
+        fprintf(stderr, "[BVH] %s: %d triangles, %s builder, estimated cost %.2f\n", filename,
+                int(li.size()), builder, root->cost);
+        return root;
+    }
+    TriangleMesh* root = new TriangleMesh(mesh, bvh_options);
+    const char* layout = bvh_options.layout == BVH_WIDE4 ? "wide4"
+                       : bvh_options.layout == BVH_WIDE8 ? "wide8" : "linear";
+    fprintf(stderr, "[BVH] %s: %d triangles, %s builder, %s layout, estimated cost %.2f, "
+            "%.1f MB, built in %.1f ms\n", filename, root->n_tris, builder, layout,
+            root->cost(bvh_options.leaf_cost), root->memory() / 1048576.0, root->build_time * 1000);
+    if (use_cache && !save_mesh_cache(bvh_cache_dir, cache_path, key, *root))
+        fprintf(stderr, "[BVH] cannot write cache file %s\n", cache_path.c_str());
     // fprintf(stderr, "list size %d \n", int(li.size()) );
-    // fprintf(stderr, "traingle mesh %d\n", answer->get_all_triangles()->getList().size());
     return root;
 }
 
@@ -803,6 +989,49 @@ ConstantMedium *SceneParser::parseMedium() {
     return cm;
 }
 
+GridMedium *SceneParser::parseGridMedium() {
+    char token[MAX_PARSER_TOKEN_LENGTH];
+    char filename[MAX_PARSER_TOKEN_LENGTH] = "";
+    Vec3 lo, hi(1, 1, 1), color(1, 1, 1);
+    int res[3] = {32, 32, 32};
+    double dense = 1, frequency = 0;
+    getToken(token);
+    assert (!strcmp(token, "{"));
+    while (true) {
+        getToken(token);
+        if (!strcmp(token, "min")) {
+            lo = readVec3();
+        } else if (!strcmp(token, "max")) {
+            hi = readVec3();
+        } else if (!strcmp(token, "resolution")) {
+            for (int a = 0; a < 3; ++a)
+                res[a] = readInt();
+        } else if (!strcmp(token, "file")) {
+            getToken(filename);
+        } else if (!strcmp(token, "noise")) {
+            frequency = readDouble();
+        } else if (!strcmp(token, "dense")) {
+            dense = readDouble();
+        } else if (!strcmp(token, "color")) {
+            color = readVec3();
+        } else {
+            assert (!strcmp(token, "}"));
+            break;
+        }
+    }
+    AABB box(lo, hi);
+    std::vector<float> values;
+    if (filename[0]) {
+        if (!load_density_grid(filename, size_t(res[0]) * res[1] * res[2], values)) {
+            printf("Cannot read %dx%dx%d density voxels from %s\n", res[0], res[1], res[2], filename);
+            exit(0);
+        }
+    } else {
+        values = noise_density_grid(box, res[0], res[1], res[2], frequency);
+    }
+    return new GridMedium(box, res[0], res[1], res[2], std::move(values), dense, color);
+}
+
 
 // ====================================================================
 // ====================================================================
@@ -5,6 +5,7 @@
 #include "ray.hpp"
 #include "material.hpp"
 #include "bbox.hpp"
+#include "packet.hpp"
 #include <vector>
 
 const double MAX_double = 10000000000.0;
@@ -17,12 +18,149 @@ double det(const Vec3& a, const Vec3& b, const Vec3& c) {
 }
 
 
+// Converts the pdf 1 / area of picking point p on a surface to a pdf per
+// solid angle seen from `origin`, and sets the direction and distance to p.
+double area_to_solid_angle(const Vec3 &origin, const Vec3 &p, const Vec3 &norm, double area,
+                           Vec3 &dir, double &dist) {
+    Vec3 op = p - origin;
+    double d2 = op.len2();
+    if (d2 <= 0)
+        return 0;
+    dist = sqrt(d2);
+    dir = op / dist;
+    double cosine = fabs(norm.dot(dir));
+    if (cosine < 1e-8 || area <= 0)
+        return 0;
+    return d2 / (cosine * area);
+}
+
+
+// Distances at which a line crosses the surface of a closed object, in
+// increasing order: the line is inside from t[0] to t[1], from t[2] to
+// t[3] and so on. Only the window a ray needs is kept: the nearest
+// crossings after its origin, and before them the last one behind it if
+// the origin is inside. overflow tells that crossings after the origin
+// were dropped, so the line past t[n - 1] is unknown.
+struct Crossings {
+    static const int MAX = 32;
+    int n = 0;
+    double t[MAX];
+    double behind = -INFINITY;  // the last crossing before the origin
+    bool overflow = false;
+
+    void add(double tt) {
+        if (tt < 0) {
+            behind = fmax(behind, tt);
+            return;
+        }
+        // one place stays free for behind
+        if (n == MAX - 1) {
+            overflow = true;
+            if (tt >= t[n - 1])
+                return;
+        }
+        int i = n < MAX - 1 ? n++ : n - 1;
+        for (; i > 0 && t[i - 1] > tt; --i)
+            t[i] = t[i - 1];
+        t[i] = tt;
+    }
+    // Call once all are added. Merges crossings closer than eps, where a
+    // line passes through an edge that two triangles share, and puts the
+    // one behind first if the origin is inside: a line crosses a closed
+    // surface an even number of times, so that is when an odd number is
+    // left after the origin.
+    void merge(double eps = 0.0001) {
+        int m = 0;
+        double last = behind;
+        for (int i = 0; i < n; ++i)
+            if (t[i] > last + eps)
+                last = t[m++] = t[i];
+        n = m;
+        if (n % 2 == 1) {
+            for (int i = n; i > 0; --i)
+                t[i] = t[i - 1];
+            t[0] = behind;
+            ++n;
+        }
+    }
+};
+
 class AABB;
 class Object {
 public:
-    Material *material;
+    Material *material = nullptr;
+    int id = 0;  // of the top level object it belongs to, from 1 in scene order
+    virtual ~Object() {}
+    // Numbers a top level object. Hits report the primitive they found,
+    // so aggregates pass the number on to what they hold.
+    virtual void set_id(int id_) { id = id_; }
+    // Finds the closest hit in (t_min, t_max). Only sets hit.t, hit.obj and
+    // what get_surface of hit.obj needs, and leaves `hit` untouched on a miss.
     virtual bool intersect(const Ray &r, double t_min, double t_max, Hit &hit) const = 0;
     virtual bool bounding_box(double t0, double t1, AABB& box) const = 0;
+    // Whether anything lies in (t_min, t_max), for shadow and visibility
+    // rays. Aggregates override it to stop at the first hit; for a single
+    // primitive intersect already computes no more than the distance.
+    virtual bool occluded(const Ray &r, double t_min, double t_max) const {
+        Hit hit;
+        return intersect(r, t_min, t_max, hit);
+    }
+    // Fills position, normal, texture coordinates and material of a hit
+    // found by intersect. Aggregates never appear in hit.obj.
+    virtual void get_surface(const Ray &r, Hit &hit) const {}
+    // intersect for rays first.. of a packet, lowering their t_max and
+    // setting found. BVHs override it to traverse once for the packet.
+    virtual void intersect_packet(RayPacket &p, int first) const {
+        for (int i = first; i < p.n; ++i)
+            if (intersect(p.rays[i], p.t_min, p.t_max[i], p.hits[i])) {
+                p.t_max[i] = p.hits[i].t;
+                p.found[i] = true;
+            }
+    }
+    // The crossings of the whole line of r, behind its origin too, for
+    // objects that bound media. Shapes and meshes find them in one query;
+    // by default the last one behind comes from the reversed ray and those
+    // after are collected one closest hit at a time.
+    virtual void crossings(const Ray &r, Crossings &c) const {
+        Hit hit;
+        Ray back = r;
+        back.d = r.d * -1;
+        if (intersect(back, 0, INFINITY, hit))
+            c.add(-hit.t);
+        double t = 0;
+        while (!c.overflow && intersect(r, t, INFINITY, hit)) {
+            c.add(hit.t);
+            t = hit.t + 0.0001;
+        }
+        c.merge();
+    }
+
+    // Emitters that next event estimation can sample. sample_direction
+    // picks a direction from `origin` to a point of the surface, sets the
+    // distance to it and returns the solid angle pdf, or 0 when it cannot
+    // sample from there. pdf_direction is that pdf for a direction that
+    // hit the surface at `hit`.
+    virtual bool samplable() const { return false; }
+    virtual double sample_direction(const Vec3 &origin, Sampler &sampler,
+                                    Vec3 &dir, double &dist) const { return 0; }
+    virtual double pdf_direction(const Vec3 &origin, const Hit &hit) const { return 0; }
+    // surface area of an emitter, for the power the light BVH weighs
+    virtual double area() const { return 0; }
+
+    // closest hit with its surface data
+    bool closest_hit(const Ray &r, double t_min, double t_max, Hit &hit) const {
+        if (!intersect(r, t_min, t_max, hit))
+            return false;
+        hit.obj->get_surface(r, hit);
+        return true;
+    }
+    // closest_hit for every ray of a prepared packet
+    void closest_hit_packet(RayPacket &p) const {
+        intersect_packet(p, 0);
+        for (int i = 0; i < p.n; ++i)
+            if (p.found[i])
+                p.hits[i].obj->get_surface(p.rays[i], p.hits[i]);
+    }
 };
 
 
@@ -39,19 +177,31 @@ public:
     }
     Object* & operator[] (int i) {return list[i];}
     std::vector<Object *> getList() {return list;}
+    virtual void set_id(int id_) override {
+        id = id_;
+        for (Object *obj : list)
+            obj->set_id(id_);
+    }
     virtual bool intersect(const Ray &r, double t_min, double t_max, Hit &hit) const override {
         bool if_hit = false;
-        Hit tmp_hit;
-        double tmp_t = t_max;
         for (int i = 0; i < list.size(); ++i) {
-            if (list[i]->intersect(r, t_min, tmp_t, tmp_hit)) {
+            if (list[i]->intersect(r, t_min, t_max, hit)) {
                 if_hit = true;
-                tmp_t = tmp_hit.t;
-                hit = tmp_hit;
+                t_max = hit.t;
             }
         }
         return if_hit;
     }
+    virtual bool occluded(const Ray &r, double t_min, double t_max) const override {
+        for (int i = 0; i < list.size(); ++i)
+            if (list[i]->occluded(r, t_min, t_max))
+                return true;
+        return false;
+    }
+    virtual void intersect_packet(RayPacket &p, int first) const override {
+        for (int i = 0; i < list.size(); ++i)
+            list[i]->intersect_packet(p, first);
+    }
     virtual bool bounding_box(double t0, double t1, AABB& box) const override {
         if (list.empty()) 
             return false;
@@ -88,33 +238,73 @@ public:
             double tmp = (b - sqrt(det));
             if (tmp > t_min && tmp < t_max) {
                 hit.t = tmp;
-                hit.p = r.point(tmp);
-                hit.norm = (hit.p - center) / radius;
-                hit.norm.normalize();
-                hit.material = this->material;
-                get_UV(hit.norm, hit.u, hit.v);
+                hit.obj = this;
                 // fprintf(stderr, "true %f\n", tmp);
                 return true;
             }
             tmp = (b + sqrt(det));
             if (tmp > t_min && tmp < t_max) {
                 hit.t = tmp;
-                hit.p = r.point(tmp);
-                hit.norm = (hit.p - center) / radius;
-                hit.norm.normalize();
-                // fprintf(stderr, "norm %f \n", hit.norm.len());
-                hit.material = this->material;
-                get_UV(hit.norm, hit.u, hit.v);
+                hit.obj = this;
                 return true;
             }
         }
         return false;
     }
+    // both roots at once
+    virtual void crossings(const Ray &r, Crossings &c) const override {
+        Vec3 op = center - r.o;
+        double b = op.dot(r.direction()), det = b * b - op.len2() + radius * radius;
+        if (det > 0) {
+            c.add(b - sqrt(det));
+            c.add(b + sqrt(det));
+            c.merge();
+        }
+    }
+    virtual void get_surface(const Ray &r, Hit &hit) const override {
+        hit.p = r.point(hit.t);
+        hit.norm = (hit.p - center) / radius;
+        hit.norm.normalize();
+        hit.material = this->material;
+        get_UV(hit.norm, hit.u, hit.v);
+    }
     virtual bool bounding_box(double t0, double t1, AABB& box) const override {
         box = AABB(center - Vec3(radius, radius, radius), 
                    center + Vec3(radius, radius, radius));
         return true;
     }
+
+    // uniform in the cone of directions the sphere subtends
+    virtual bool samplable() const override { return true; }
+    virtual double sample_direction(const Vec3 &origin, Sampler &sampler,
+                                    Vec3 &dir, double &dist) const override {
+        Vec3 oc = center - origin;
+        double d2 = oc.len2(), one_minus_cos_max = cone(d2);
+        if (one_minus_cos_max <= 0)
+            return 0;
+        Vec3 w = oc / sqrt(d2), u, v;
+        build_onb(w, u, v);
+        double u1, u2;
+        sampler.next_2d(u1, u2);
+        double cos_t = 1 - u1 * one_minus_cos_max;
+        double sin_t = sqrt(fmax(0.0, 1 - cos_t * cos_t)), phi = 2 * PI * u2;
+        dir = u * (cos(phi) * sin_t) + v * (sin(phi) * sin_t) + w * cos_t;
+        double b = oc.dot(dir);
+        dist = b - sqrt(fmax(0.0, b * b - d2 + radius * radius));
+        return 1 / (2 * PI * one_minus_cos_max);
+    }
+    virtual double pdf_direction(const Vec3 &origin, const Hit &hit) const override {
+        double one_minus_cos_max = cone((center - origin).len2());
+        return one_minus_cos_max > 0 ? 1 / (2 * PI * one_minus_cos_max) : 0;
+    }
+    virtual double area() const override { return 4 * PI * radius * radius; }
+
+private:
+    // 1 - cos of the half angle of the cone, 0 from inside the sphere
+    double cone(double d2) const {
+        double s2 = radius * radius / d2;
+        return s2 < 1 ? s2 / (1 + sqrt(1 - s2)) : 0;
+    }
 };
 
 class Triangle: public Object {
@@ -146,16 +336,37 @@ public:
 		if (t > t_min && t < t_max) {
 			if (b >= 0 && b <= 1 && r >= 0 && r <= 1 && b + r <= 1) {
 				hit.t = t;
-                hit.norm = this->norm;
-                hit.p = ray.point(t);
-                hit.material = this->material;
-                Vec3 calc = vertices[0] - hit.p;
+                hit.obj = this;
 				return true;
 			}
 		}
 		return false;
 	}
+    virtual void get_surface(const Ray &ray, Hit &hit) const override {
+        hit.p = ray.point(hit.t);
+        hit.norm = this->norm;
+        hit.material = this->material;
+        hit.u = hit.v = 0.0;
+    }
     Vec3 normal() { return this->norm; }
+
+    // uniform over the area
+    virtual bool samplable() const override { return true; }
+    virtual double sample_direction(const Vec3 &origin, Sampler &sampler,
+                                    Vec3 &dir, double &dist) const override {
+        double u1, u2;
+        sampler.next_2d(u1, u2);
+        double su = sqrt(u1), b1 = su * u2;
+        Vec3 p = vertices[0] * (1 - su) + vertices[1] * (su - b1) + vertices[2] * b1;
+        return area_to_solid_angle(origin, p, this->norm, area(), dir, dist);
+    }
+    virtual double pdf_direction(const Vec3 &origin, const Hit &hit) const override {
+        Vec3 dir;
+        double dist;
+        return area_to_solid_angle(origin, hit.p, this->norm, area(), dir, dist);
+    }
+    virtual double area() const override { return ((vertices[1] - vertices[0]) % (vertices[2] - vertices[0])).len() / 2; }
+
     virtual bool bounding_box(double t0, double t1, AABB& box) const override {
         Vec3 vert[3];
         for (int i = 0; i < 3; ++i)
@@ -208,26 +419,26 @@ public:
             double tmp = (b - sqrt(det));
             if (tmp > t_min && tmp < t_max) {
                 hit.t = tmp;
-                hit.p = r.point(tmp);
-                hit.norm = (hit.p - center) / radius;
-                hit.norm.normalize();
-                hit.material = this->material;
+                hit.obj = this;
                 // fprintf(stderr, "true %f\n", tmp);
                 return true;
             }
             tmp = (b + sqrt(det));
             if (tmp > t_min && tmp < t_max) {
                 hit.t = tmp;
-                hit.p = r.point(tmp);
-                hit.norm = (hit.p - center) / radius;
-                hit.norm.normalize();
-                // fprintf(stderr, "norm %f \n", hit.norm.len());
-                hit.material = this->material;
+                hit.obj = this;
                 return true;
             }
         }
         return false;
     }
+    virtual void get_surface(const Ray &r, Hit &hit) const override {
+        hit.p = r.point(hit.t);
+        hit.norm = (hit.p - get_center(r.time)) / radius;
+        hit.norm.normalize();
+        hit.material = this->material;
+        hit.u = hit.v = 0.0;
+    }
     virtual bool bounding_box(double t0, double t1, AABB& box) const override {
         AABB box1(get_center(t0) - Vec3(radius, radius, radius), 
                    get_center(t0) + Vec3(radius, radius, radius));
@@ -261,15 +472,38 @@ public:
         bool res1 = tr1->intersect(ray, t_min, t_max, hit);
         t_max = res1 ? hit.t : t_max;
         bool res2 = tr2->intersect(ray, t_min, t_max, hit);
-        double t = 0.0, b = 0.0, r = 0.0;
 		res1 =  res1 || res2;
-        if (res1) {
-            get_UV(hit.p, hit.v, hit.u);
-            hit.norm = this->norm;
-        }
+        if (res1)
+            hit.obj = this;
         return res1;
 	}
+    virtual bool occluded(const Ray &ray, double t_min, double t_max) const override {
+        return tr1->occluded(ray, t_min, t_max) || tr2->occluded(ray, t_min, t_max);
+    }
+    virtual void get_surface(const Ray &ray, Hit &hit) const override {
+        hit.p = ray.point(hit.t);
+        hit.norm = this->norm;
+        hit.material = this->material;
+        get_UV(hit.p, hit.v, hit.u);
+    }
     Vec3 normal() { return this->norm; }
+
+    // uniform over the area
+    virtual bool samplable() const override { return true; }
+    virtual double sample_direction(const Vec3 &origin, Sampler &sampler,
+                                    Vec3 &dir, double &dist) const override {
+        double u1, u2;
+        sampler.next_2d(u1, u2);
+        Vec3 p = vertices[1] + (vertices[0] - vertices[1]) * u1 + (vertices[2] - vertices[1]) * u2;
+        return area_to_solid_angle(origin, p, this->norm, area(), dir, dist);
+    }
+    virtual double pdf_direction(const Vec3 &origin, const Hit &hit) const override {
+        Vec3 dir;
+        double dist;
+        return area_to_solid_angle(origin, hit.p, this->norm, area(), dir, dist);
+    }
+    virtual double area() const override { return ((vertices[0] - vertices[1]) % (vertices[2] - vertices[1])).len(); }
+
     virtual bool bounding_box(double t0, double t1, AABB& box) const override {
         AABB b1, b2;
         tr1->bounding_box(t0, t1, b1);
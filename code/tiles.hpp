@@ -0,0 +1,182 @@
+#ifndef __TILES_H__
+#define __TILES_H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Square tiles of the image, the unit of work of the render threads.
+
+struct Tile
+{
+    int x0, y0, x1, y1;  // pixels [x0, x1) x [y0, y1)
+};
+
+enum TileOrder { TILES_MORTON, TILES_CENTER, TILES_ROWS };
+
+inline bool parse_tile_order(const char *name, TileOrder &order)
+{
+    if (!strcmp(name, "morton"))
+        order = TILES_MORTON;
+    else if (!strcmp(name, "center"))
+        order = TILES_CENTER;
+    else if (!strcmp(name, "rows"))
+        order = TILES_ROWS;
+    else
+        return false;
+    return true;
+}
+
+// interleaves the bits of x and y
+inline uint64_t morton_code(uint32_t x, uint32_t y)
+{
+    uint64_t code = 0;
+    for (int i = 0; i < 32; ++i)
+        code |= uint64_t(x >> i & 1) << (2 * i) | uint64_t(y >> i & 1) << (2 * i + 1);
+    return code;
+}
+
+// Morton order keeps consecutive tiles next to each other, so a thread
+// that works through a run of them reuses the same part of the BVH;
+// center-out order finishes the middle of the image first.
+std::vector<Tile> make_tiles(int w, int h, int size, TileOrder order)
+{
+    int nx = (w + size - 1) / size, ny = (h + size - 1) / size;
+    std::vector<Tile> tiles;
+    std::vector<double> keys;
+    for (int ty = 0; ty < ny; ++ty)
+        for (int tx = 0; tx < nx; ++tx)
+        {
+            Tile t = {tx * size, ty * size, std::min(w, (tx + 1) * size), std::min(h, (ty + 1) * size)};
+            tiles.push_back(t);
+            double dx = tx + 0.5 - nx / 2.0, dy = ty + 0.5 - ny / 2.0;
+            keys.push_back(order == TILES_MORTON ? double(morton_code(tx, ty))
+                           : order == TILES_CENTER ? dx * dx + dy * dy
+                           : double(tiles.size()));
+        }
+    std::vector<int> index(tiles.size());
+    for (int i = 0; i < (int) index.size(); ++i)
+        index[i] = i;
+    std::stable_sort(index.begin(), index.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+    std::vector<Tile> sorted;
+    for (int i : index)
+        sorted.push_back(tiles[i]);
+    return sorted;
+}
+
+// Work stealing over a list of tiles. Every thread owns a contiguous run
+// of the list and takes tiles from its front; a thread whose run is empty
+// steals from the back of another's, so the owners keep their coherent
+// fronts. A run is a packed [begin, end) updated by compare and swap.
+class TileQueue
+{
+public:
+    TileQueue(int n_tiles, int n_threads) : runs(n_threads)
+    {
+        for (int t = 0; t < n_threads; ++t)
+            runs[t].range = pack(uint32_t(int64_t(n_tiles) * t / n_threads),
+                                 uint32_t(int64_t(n_tiles) * (t + 1) / n_threads));
+    }
+
+    // the next tile for `thread`, false when all are taken
+    bool next(int thread, int &tile)
+    {
+        if (take(runs[thread].range, true, tile))
+            return true;
+        for (int i = 1; i < (int) runs.size(); ++i)
+            if (take(runs[(thread + i) % runs.size()].range, false, tile))
+            {
+                ++runs[thread].steals;
+                return true;
+            }
+        return false;
+    }
+
+    long long steals() const
+    {
+        long long n = 0;
+        for (const Run &r : runs)
+            n += r.steals;
+        return n;
+    }
+
+private:
+    // One run per cache line. The runs are 64 bytes apart; before C++17
+    // the vector's storage is only 16 byte aligned, which still keeps the
+    // 16 bytes a run uses within one line.
+    struct alignas(64) Run
+    {
+        std::atomic<uint64_t> range;
+        long long steals = 0;  // written by the owner only
+    };
+    std::vector<Run> runs;
+
+    static uint64_t pack(uint32_t begin, uint32_t end) { return uint64_t(end) << 32 | begin; }
+
+    static bool take(std::atomic<uint64_t> &range, bool front, int &tile)
+    {
+        uint64_t r = range.load();
+        for (;;)
+        {
+            uint32_t begin = uint32_t(r), end = uint32_t(r >> 32);
+            if (begin >= end)
+                return false;
+            uint64_t rest = front ? pack(begin + 1, end) : pack(begin, end - 1);
+            if (range.compare_exchange_weak(r, rest))
+            {
+                tile = front ? begin : end - 1;
+                return true;
+            }
+        }
+    }
+};
+
+// Progress of the render. Threads report finished tiles with a single
+// atomic add; whichever thread finds the last report older than the
+// interval claims the next one, so only one thread prints at a time.
+class Progress
+{
+    typedef std::chrono::steady_clock Clock;
+
+public:
+    Progress(const char *label_, long long total_) : label(label_), total(total_), start(Clock::now()) {}
+
+    void add(long long work)
+    {
+        long long now_done = done.fetch_add(work) + work;
+        long long now = (long long) elapsed_ms(), last = last_print.load();
+        // the thread that finishes the last tile always prints
+        if (now_done == total || (now - last >= 200 && last_print.compare_exchange_strong(last, now)))
+            fprintf(stderr, "\r%s %5.2f%%", label, 100.0 * now_done / total);
+    }
+
+    double elapsed_ms() const
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+private:
+    const char *label;
+    long long total;
+    Clock::time_point start;
+    std::atomic<long long> done{0}, last_print{-1000};
+};
+
+// summary of the render times of the tiles, in milliseconds
+void print_tile_stats(FILE *f, std::vector<double> ms, int size, long long steals)
+{
+    if (ms.empty())
+        return;
+    std::sort(ms.begin(), ms.end());
+    double total = 0;
+    for (double t : ms)
+        total += t;
+    fprintf(f, "[Tiles] %d tiles of %dx%d, %lld stolen: %.2f ms mean, %.2f ms median, %.2f ms slowest\n",
+            int(ms.size()), size, size, steals, total / ms.size(), ms[ms.size() / 2], ms.back());
+}
+
+#endif
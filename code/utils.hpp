@@ -4,6 +4,7 @@
 #include <cstdio>
 #include <math.h>
 #include <cstdlib>
+#include "sampler.hpp"
 
 const double PI = acos(-1);
 
@@ -51,20 +52,83 @@ struct Vec3
         if (i == 1) return y;
         else return z;
     }
+    double operator [] ( int i ) const {
+        if (i == 0) return x;
+        if (i == 1) return y;
+        else return z;
+    }
     double dot(const Vec3 &b) const { return x * b.x + y * b.y + z * b.z; } // cross:
-    Vec3 operator%(const Vec3 &b) { return Vec3(y * b.z - z * b.y, z * b.x - x * b.z, x * b.y - y * b.x); }
+    Vec3 operator%(const Vec3 &b) const { return Vec3(y * b.z - z * b.y, z * b.x - x * b.z, x * b.y - y * b.x); }
     Vec3 clip() const { return Vec3(clamp(x), clamp(y), clamp(z)); }
-    Vec3 reflect(const Vec3 &n) { return (*this) - n * 2 * n.dot(*this); }
+    Vec3 reflect(const Vec3 &n) const { return (*this) - n * 2 * n.dot(*this); }
 };
 
-Vec3 random_in_unit_sphere()
+// orthonormal basis (u, v, w) around the unit vector w, without square
+// roots or branches (Duff et al. 2017)
+void build_onb(const Vec3 &w, Vec3 &u, Vec3 &v)
+{
+    double sign = copysign(1.0, w.z);
+    double a = -1 / (sign + w.z), b = w.x * w.y * a;
+    u = Vec3(1 + sign * w.x * w.x * a, sign * b, -sign * w.x);
+    v = Vec3(b, sign + w.y * w.y * a, -w.y);
+}
+
+// Closed form warps of two uniform numbers in [0, 1), for sampling without
+// rejection loops.
+
+// unit disk, concentric mapping (Shirley & Chiu), keeps strata compact
+Vec3 sample_concentric_disk(double u1, double u2)
 {
-    Vec3 res;
-    do
+    double a = 2 * u1 - 1, b = 2 * u2 - 1;
+    if (a == 0 && b == 0)
+        return Vec3(0, 0, 0);
+    double r, phi;
+    if (fabs(a) > fabs(b))
+    {
+        r = a;
+        phi = PI / 4 * (b / a);
+    }
+    else
     {
-        res = Vec3(drand48(), drand48(), drand48()) * 2 - Vec3(1, 1, 1);
-    } while (res.len2() >= 1);
-    return res;
+        r = b;
+        phi = PI / 2 - PI / 4 * (a / b);
+    }
+    return Vec3(r * cos(phi), r * sin(phi), 0);
+}
+
+// around +z with pdf cos(theta) / PI
+Vec3 sample_cosine_hemisphere(double u1, double u2)
+{
+    Vec3 d = sample_concentric_disk(u1, u2);
+    d.z = sqrt(fmax(0.0, 1 - d.x * d.x - d.y * d.y));
+    return d;
+}
+
+// pdf 1 / (4 PI)
+Vec3 sample_uniform_sphere(double u1, double u2)
+{
+    double z = 1 - 2 * u1, r = sqrt(fmax(0.0, 1 - z * z)), phi = 2 * PI * u2;
+    return Vec3(r * cos(phi), r * sin(phi), z);
+}
+
+// around +z with pdf (n + 1) / (2 PI) cos(theta)^n
+Vec3 sample_phong_lobe(double n, double u1, double u2)
+{
+    double z = pow(u1, 1 / (n + 1)), r = sqrt(fmax(0.0, 1 - z * z)), phi = 2 * PI * u2;
+    return Vec3(r * cos(phi), r * sin(phi), z);
+}
+
+double phong_lobe_pdf(double n, double cosine)
+{
+    return cosine > 0 ? (n + 1) / (2 * PI) * pow(cosine, n) : 0;
+}
+
+// a direction sampled around +z, expressed around the unit vector w
+Vec3 local_to_world(const Vec3 &d, const Vec3 &w)
+{
+    Vec3 u, v;
+    build_onb(w, u, v);
+    return u * d.x + v * d.y + w * d.z;
 }
 
 
@@ -0,0 +1,115 @@
+#ifndef __WAVEFRONT_H__
+#define __WAVEFRONT_H__
+
+#include "integrator.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// A path of a wavefront batch and where its sampler left off.
+struct WavefrontPath
+{
+    PathState path;
+    Features features;  // see PathTracer::radiance
+    bool find_features = true;
+    uint64_t pixel;  // sampler pixel and sample of the path
+    int sample;
+};
+
+// Breadth-first schedule of PathTracer: a batch of paths advances one
+// bounce at a time, each stage running over the whole batch before the
+// next starts. Extend finds the closest hits of all live paths; shade
+// runs over them sorted by material, so paths on the same material are
+// shaded together; the shadow rays shade produced are then traced as one
+// batch, and the paths still alive are compacted for the next bounce.
+//
+// The sampler is repositioned on each path's sample for every stage, so
+// a path draws the same numbers as under PathTracer::radiance and gives
+// the same result.
+class WavefrontTracer
+{
+public:
+    WavefrontTracer(const PathTracer &tracer_) : tracer(tracer_) {}
+
+    // Traces every path of the batch from its camera ray; the radiance is
+    // left in path.color.
+    void trace(std::vector<WavefrontPath> &batch, Sampler &sampler, PathStats &stats)
+    {
+        int n = int(batch.size());
+        hits.resize(n);
+        found.resize(n);
+        dims.resize(n);
+        shadows.resize(n);
+        shadowed.resize(n);
+        active.clear();
+        for (int i = 0; i < n; ++i)
+            active.push_back(i);
+        stats.paths += n;
+        while (!active.empty())
+        {
+            // extend
+            for (int i : active)
+            {
+                resume(batch[i], sampler, -1);
+                hits[i] = Hit();
+                found[i] = tracer.extend(batch[i].path, sampler, hits[i]);
+                if (batch[i].find_features)
+                    tracer.record_features(batch[i].path, found[i], hits[i], batch[i].features);
+                dims[i] = sampler.dimension();
+            }
+            // shade, grouped by material; misses come first
+            order = active;
+            std::sort(order.begin(), order.end(), [&](int a, int b) {
+                uintptr_t ka = found[a] ? uintptr_t(hits[a].material) : 0;
+                uintptr_t kb = found[b] ? uintptr_t(hits[b].material) : 0;
+                return ka != kb ? ka < kb : a < b;
+            });
+            for (int i : order)
+            {
+                resume(batch[i], sampler, dims[i]);
+                bool is_shadowed;
+                bool alive = tracer.shade(batch[i].path, found[i], hits[i], sampler, stats,
+                                          shadows[i], is_shadowed);
+                shadowed[i] = is_shadowed;
+                found[i] = alive;
+                batch[i].find_features = batch[i].find_features && batch[i].path.specular;
+                dims[i] = sampler.dimension();
+            }
+            // connect the light samples
+            for (int i : active)
+                if (shadowed[i])
+                {
+                    resume(batch[i], sampler, dims[i]);
+                    double v = tracer.visibility(shadows[i]);
+                    if (v > 0)
+                        batch[i].path.color += shadows[i].color * v;
+                }
+            // compact, keeping the batch order
+            int live = 0;
+            for (int i : active)
+                if (found[i])
+                    active[live++] = i;
+            active.resize(live);
+        }
+    }
+
+private:
+    const PathTracer &tracer;
+    // per path of the batch
+    std::vector<Hit> hits;
+    std::vector<char> found, shadowed;
+    std::vector<int> dims;
+    std::vector<ShadowRay> shadows;
+    // live paths, and the same sorted for shading
+    std::vector<int> active, order;
+
+    static void resume(const WavefrontPath &p, Sampler &sampler, int dim)
+    {
+        sampler.start_pixel(p.pixel);
+        sampler.start_sample(p.sample);
+        if (dim >= 0)
+            sampler.set_dimension(dim);
+    }
+};
+
+#endif